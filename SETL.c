@@ -15,6 +15,41 @@ void die(int lineNo);
 long long wallClockTime();
 
 
+/***********************************************************
+   Phase timing, reported on stderr with --phases
+***********************************************************/
+
+#define PHASE_LOAD 0
+#define PHASE_EVOLVE 1
+#define PHASE_SEARCH 2
+#define PHASE_COMM 3
+#define PHASE_MERGE 4
+#define PHASE_PRINT 5
+#define NPHASES 6
+
+long long phaseTime[NPHASES];
+
+void printPhases(int size, int iterations, long long total);
+
+
+//One machine readable line for bench.sh, all times in seconds.
+//cells_per_sec counts cell generations over the timed region
+//minus printing, so it is comparable across output modes.
+void printPhases(int size, int iterations, long long total)
+{
+    long long compute;
+
+    compute = total - phaseTime[PHASE_PRINT];
+    if (compute <= 0) compute = 1;
+
+    fprintf(stderr, "PHASES load=%.6f evolve=%.6f search=%.6f comm=%.6f"
+        " merge=%.6f print=%.6f total=%.6f cells_per_sec=%.0f\n",
+        phaseTime[PHASE_LOAD] / 1e9, phaseTime[PHASE_EVOLVE] / 1e9,
+        phaseTime[PHASE_SEARCH] / 1e9, phaseTime[PHASE_COMM] / 1e9,
+        phaseTime[PHASE_MERGE] / 1e9, phaseTime[PHASE_PRINT] / 1e9,
+        total / 1e9, (double)size * size * iterations / (compute / 1e9));
+}
+
 /***********************************************************
   Square matrix related functions, used by both world and pattern
 ***********************************************************/
@@ -95,16 +130,19 @@ int main( int argc, char** argv)
     char **patterns[4];
     int dir, iterations, iter;
     int size, patternSize;
-    long long before, after;
+    int showPhases;
+    long long before, after, t;
     MATCHLIST*list;
     
     if (argc < 4 ){
         fprintf(stderr, 
-            "Usage: %s <world file> <Iterations> <pattern file>\n", argv[0]);
+            "Usage: %s <world file> <Iterations> <pattern file> [--phases]\n",
+            argv[0]);
         exit(1);
     } 
+    showPhases = (argc > 4 && strcmp(argv[4], "--phases") == 0);
 
-
+    t = wallClockTime();
     curW = readWorldFromFile(argv[1], &size);
     nextW = allocateSquareMatrix(size+2, DEAD);
 
@@ -120,6 +158,7 @@ int main( int argc, char** argv)
         rotate90(patterns[dir-1], patterns[dir], patternSize);
     }
     printf("Pattern size = %d\n", patternSize);
+    phaseTime[PHASE_LOAD] += wallClockTime() - t;
 
 #ifdef DEBUG
     printSquareMatrix(patterns[N], patternSize);
@@ -142,17 +181,23 @@ int main( int argc, char** argv)
         printSquareMatrix(curW, size+2);
 #endif
 
+        t = wallClockTime();
         searchPatterns( curW, size, iter, patterns, patternSize, list);
+        phaseTime[PHASE_SEARCH] += wallClockTime() - t;
 
         //Generate next generation
+        t = wallClockTime();
         evolveWorld( curW, nextW, size );
+        phaseTime[PHASE_EVOLVE] += wallClockTime() - t;
         temp = curW;
         curW = nextW;
         nextW = temp;
     }
 
 
+    t = wallClockTime();
     printList( list );
+    phaseTime[PHASE_PRINT] += wallClockTime() - t;
 
     //Stop timer
     after = wallClockTime();
@@ -160,6 +205,9 @@ int main( int argc, char** argv)
     printf("Sequential SETL took %1.2f seconds\n", 
         ((float)(after - before))/1000000000);
 
+    if (showPhases)
+        printPhases(size, iterations, after - before);
+
 
     //Clean up
     deleteList( list );
@@ -0,0 +1,610 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+/***********************************************************
+  Out-of-core SETL: the world is never held in memory.
+
+  Each pass streams the world file row by row through a chain of
+  rolling windows, one per generation.  A row arriving at level L is
+  searched for generation base+L and, one row later, the row above it
+  is evolved into level L+1.  A pass of k levels therefore searches k
+  generations and writes generation base+k to a scratch file, which is
+  the input of the next pass.  Working memory is k windows of
+  max(3, pSize) rows, plus stdio buffers.
+
+  Matches are spooled to scratch files per generation and rotation and
+  printed at the end in the same order and format as SETL.
+***********************************************************/
+
+/***********************************************************
+  Helper functions
+***********************************************************/
+
+//For exiting on error condition
+void die(int lineNo);
+
+//For trackinng execution
+long long wallClockTime();
+
+//A scratch file deleted when closed, in dir or in the system's tmp
+FILE* scratchFile(char* dir);
+
+
+/***********************************************************
+   Phase timing, reported on stderr with --phases
+***********************************************************/
+
+#define PHASE_LOAD 0        //reading and writing world rows
+#define PHASE_EVOLVE 1
+#define PHASE_SEARCH 2
+#define PHASE_COMM 3        //unused, kept for bench.sh
+#define PHASE_MERGE 4       //concatenating the match spools
+#define PHASE_PRINT 5
+#define NPHASES 6
+
+long long phaseTime[NPHASES];
+
+void printPhases(int size, int iterations, long long total);
+
+
+/***********************************************************
+  Square matrix related functions, used by the patterns
+***********************************************************/
+
+char** allocateSquareMatrix( int size, char defaultValue );
+
+void freeSquareMatrix( char** );
+
+
+/***********************************************************
+   World  related functions
+***********************************************************/
+
+#define ALIVE 'X'
+#define DEAD 'O'
+
+//Opens a world file and reads its size, the rows follow
+FILE* openWorldFile( char* fname, int* size );
+
+//Reads the next row of a world file into columns 1..size of row,
+//columns 0 and size+1 are set DEAD
+void readWorldRow( FILE* inf, char* row, int size );
+
+//Row i of the next generation from rows i-1, i and i+1
+void evolveRow(char* above, char* row, char* below, char* next, int size);
+
+
+/***********************************************************
+   Search related functions
+***********************************************************/
+
+//Using the compass direction to indicate the rotation of pattern
+#define N 0 //no rotation
+#define E 1 //90 degree clockwise
+#define S 2 //180 degree clockwise
+#define W 3 //90 degree anti-clockwise
+
+char** readPatternFromFile( char* fname, int* size );
+
+void rotate90(char** current, char** rotated, int size);
+
+
+/***********************************************************
+   Streaming passes
+***********************************************************/
+
+#define MAX_LEVELS 64
+#define DEFAULT_LEVELS 8
+
+typedef struct {
+    int size, pSize;
+    int nRing;              //rows per window, max(3, pSize)
+    int nLevels;            //generations in memory this pass
+    int nSearch;            //levels searched, the first nSearch
+    int base;               //generation of level 0
+    char** ring[MAX_LEVELS + 1];    //row r of level L is ring[L][r % nRing]
+    char** patterns[4];
+    FILE* spool[MAX_LEVELS][4];     //matches by level and rotation
+    long long nMatch;
+    FILE* out;              //level nLevels-1 goes here, NULL on the last pass
+} STREAM;
+
+//Rows of size+2 cells for nLevels windows
+void initStream(STREAM* st, int size, int pSize, char** patterns[4]);
+
+//Streams one world file through levels 0..nLevels-1
+void streamPass(STREAM* st, FILE* inf, char* scratch);
+
+//Row r of level has been stored in its window: search it, evolve the
+//row above it into the next level, or write it out on the last level
+void pushRow(STREAM* st, int level, int r);
+
+//Windows of level with their top left cell in global row top
+void searchRow(STREAM* st, int level, int top);
+
+//Appends the level, rotation spools of a pass to matches, in SETL's
+//order, and closes them
+void flushSpools(STREAM* st, FILE* matches);
+
+
+/***********************************************************
+   Main function
+***********************************************************/
+
+
+int main( int argc, char** argv)
+{
+    STREAM st;
+    FILE *inf, *next, *matches;
+    char **patterns[4], *scratch, buf[1 << 16];
+    int dir, iterations, levels, i;
+    int size, patternSize;
+    int showPhases;
+    long long before, after, t;
+    size_t n;
+
+    if (argc < 4 ){
+        fprintf(stderr,
+            "Usage: %s <world file> <Iterations> <pattern file> [--phases]"
+            " [--generations=<k>] [--scratch=<dir>]\n",
+            argv[0]);
+        exit(1);
+    }
+    showPhases = 0;
+    levels = DEFAULT_LEVELS;
+    scratch = NULL;
+    for (i = 4; i < argc; i++){
+        if (strcmp(argv[i], "--phases") == 0){
+            showPhases = 1;
+        } else if (strncmp(argv[i], "--generations=", 14) == 0){
+            levels = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--scratch=", 10) == 0){
+            scratch = argv[i] + 10;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (levels < 1 || levels > MAX_LEVELS){
+        fprintf(stderr, "--generations must be 1..%d\n", MAX_LEVELS);
+        exit(1);
+    }
+
+    t = wallClockTime();
+    inf = openWorldFile(argv[1], &size);
+
+    printf("World Size = %d\n", size);
+
+    iterations = atoi(argv[2]);
+    printf("Iterations = %d\n", iterations);
+
+    patterns[N] = readPatternFromFile(argv[3], &patternSize);
+    for (dir = E; dir <= W; dir++){
+        patterns[dir] = allocateSquareMatrix(patternSize, DEAD);
+        rotate90(patterns[dir-1], patterns[dir], patternSize);
+    }
+    printf("Pattern size = %d\n", patternSize);
+    phaseTime[PHASE_LOAD] += wallClockTime() - t;
+
+    //Start timer
+    before = wallClockTime();
+
+    //Actual work start
+    initStream(&st, size, patternSize, patterns);
+    matches = scratchFile(scratch);
+
+    for (st.base = 0; st.base < iterations; st.base += st.nSearch){
+        st.nSearch = iterations - st.base;
+        if (st.nSearch > levels)
+            st.nSearch = levels;
+        //The generation after the last pass is never searched
+        st.out = NULL;
+        st.nLevels = st.nSearch;
+        if (st.base + st.nSearch < iterations){
+            st.out = scratchFile(scratch);
+            st.nLevels++;
+            fprintf(st.out, "%d\n", size);
+        }
+
+        streamPass(&st, inf, scratch);
+        fclose(inf);
+
+        t = wallClockTime();
+        flushSpools(&st, matches);
+        phaseTime[PHASE_MERGE] += wallClockTime() - t;
+
+        next = st.out;
+        if (next != NULL){
+            rewind(next);
+            if (fscanf(next, "%d", &i) != 1 || i != size)
+                die(__LINE__);
+            fgetc(next);
+        }
+        inf = next;
+    }
+    if (inf != NULL)
+        fclose(inf);
+
+    t = wallClockTime();
+    printf("List size = %lld\n", st.nMatch);
+    rewind(matches);
+    while ((n = fread(buf, 1, sizeof(buf), matches)) > 0){
+        fwrite(buf, 1, n, stdout);
+    }
+    fclose(matches);
+    phaseTime[PHASE_PRINT] += wallClockTime() - t;
+
+    //Stop timer
+    after = wallClockTime();
+
+    printf("Out-of-core SETL took %1.2f seconds\n",
+        ((float)(after - before))/1000000000);
+
+    if (showPhases)
+        printPhases(size, iterations, after - before);
+
+
+    //Clean up
+    for (i = 0; i <= levels; i++){
+        freeSquareMatrix(st.ring[i]);
+    }
+
+    freeSquareMatrix( patterns[0] );
+    freeSquareMatrix( patterns[1] );
+    freeSquareMatrix( patterns[2] );
+    freeSquareMatrix( patterns[3] );
+
+    return 0;
+}
+
+/***********************************************************
+  Helper functions
+***********************************************************/
+
+
+void die(int lineNo)
+{
+    fprintf(stderr, "Error at line %d. Exiting\n", lineNo);
+    exit(1);
+}
+
+long long wallClockTime( )
+{
+#ifdef __linux__
+    struct timespec tp;
+    clock_gettime(CLOCK_REALTIME, &tp);
+    return (long long)(tp.tv_nsec + (long long)tp.tv_sec * 1000000000ll);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)(tv.tv_usec * 1000 + (long long)tv.tv_sec * 1000000000ll);
+#endif
+}
+
+FILE* scratchFile(char* dir)
+{
+    char name[4096];
+    FILE* f;
+    int fd;
+
+    if (dir == NULL){
+        f = tmpfile();
+    } else {
+        snprintf(name, sizeof(name), "%s/SETL_ooc.XXXXXX", dir);
+        fd = mkstemp(name);
+        if (fd < 0)
+            die(__LINE__);
+        unlink(name);
+        f = fdopen(fd, "w+");
+    }
+    if (f == NULL)
+        die(__LINE__);
+    return f;
+}
+
+//One machine readable line for bench.sh, all times in seconds.
+//cells_per_sec counts cell generations over the timed region
+//minus printing, so it is comparable across output modes.
+void printPhases(int size, int iterations, long long total)
+{
+    long long compute;
+
+    compute = total - phaseTime[PHASE_PRINT];
+    if (compute <= 0) compute = 1;
+
+    fprintf(stderr, "PHASES load=%.6f evolve=%.6f search=%.6f comm=%.6f"
+        " merge=%.6f print=%.6f total=%.6f cells_per_sec=%.0f\n",
+        phaseTime[PHASE_LOAD] / 1e9, phaseTime[PHASE_EVOLVE] / 1e9,
+        phaseTime[PHASE_SEARCH] / 1e9, phaseTime[PHASE_COMM] / 1e9,
+        phaseTime[PHASE_MERGE] / 1e9, phaseTime[PHASE_PRINT] / 1e9,
+        total / 1e9, (double)size * size * iterations / (compute / 1e9));
+}
+
+/***********************************************************
+  Square matrix related functions, used by the patterns
+***********************************************************/
+
+char** allocateSquareMatrix( int size, char defaultValue )
+{
+
+    char* contiguous;
+    char** matrix;
+    int i;
+
+    //Using a least compiler version dependent approach here
+    //C99, C11 have a nicer syntax.
+    contiguous = (char*) malloc(sizeof(char) * size * size);
+    if (contiguous == NULL)
+        die(__LINE__);
+
+
+    memset(contiguous, defaultValue, size * size );
+
+    //Point the row array to the right place
+    matrix = (char**) malloc(sizeof(char*) * size );
+    if (matrix == NULL)
+        die(__LINE__);
+
+    matrix[0] = contiguous;
+    for (i = 1; i < size; i++){
+        matrix[i] = &contiguous[i*size];
+    }
+
+    return matrix;
+}
+
+void freeSquareMatrix( char** matrix )
+{
+    if (matrix == NULL) return;
+
+    free( matrix[0] );
+    free( matrix );
+}
+
+/***********************************************************
+   World  related functions
+***********************************************************/
+
+FILE* openWorldFile( char* fname, int* sizePtr )
+{
+    FILE* inf;
+    char temp;
+
+    inf = fopen(fname,"r");
+    if (inf == NULL)
+        die(__LINE__);
+
+    if (fscanf(inf, "%d", sizePtr) != 1 || *sizePtr < 1)
+        die(__LINE__);
+    fscanf(inf, "%c", &temp);
+    return inf;
+}
+
+void readWorldRow( FILE* inf, char* row, int size )
+{
+    row[0] = DEAD;
+    row[size + 1] = DEAD;
+    if (fread(&row[1], 1, size, inf) != (size_t) size)
+        die(__LINE__);
+    fgetc(inf);     //end of line
+}
+
+void evolveRow(char* above, char* row, char* below, char* next, int size)
+{
+    int j, left, mid, right, count;
+
+    //Live cells per column of the three rows, slid along the row
+    left = (above[0] == ALIVE) + (row[0] == ALIVE) + (below[0] == ALIVE);
+    mid = (above[1] == ALIVE) + (row[1] == ALIVE) + (below[1] == ALIVE);
+    for (j = 1; j <= size; j++){
+        right = (above[j+1] == ALIVE) + (row[j+1] == ALIVE)
+            + (below[j+1] == ALIVE);
+        count = left + mid + right - (row[j] == ALIVE);
+        if (row[j] == ALIVE)
+            next[j] = (count == 2 || count == 3) ? ALIVE : DEAD;
+        else
+            next[j] = (count == 3) ? ALIVE : DEAD;
+        left = mid;
+        mid = right;
+    }
+    next[0] = DEAD;
+    next[size + 1] = DEAD;
+}
+
+/***********************************************************
+   Search related functions
+***********************************************************/
+
+char** readPatternFromFile( char* fname, int* sizePtr )
+{
+    FILE* inf;
+
+    char temp, **pattern;
+    int i, j;
+    int size;
+
+    inf = fopen(fname,"r");
+    if (inf == NULL)
+        die(__LINE__);
+
+
+    fscanf(inf, "%d", &size);
+    fscanf(inf, "%c", &temp);
+
+    pattern = allocateSquareMatrix( size, DEAD );
+
+    for (i = 0; i < size; i++){
+        for (j = 0; j < size; j++){
+            fscanf(inf, "%c", &pattern[i][j]);
+        }
+        fscanf(inf, "%c", &temp);
+    }
+    fclose(inf);
+
+    *sizePtr = size;    //return size
+    return pattern;
+}
+
+
+void rotate90(char** current, char** rotated, int size)
+{
+    int i, j;
+
+    for (i = 0; i < size; i++){
+        for (j = 0; j < size; j++){
+            rotated[j][size-i-1] = current[i][j];
+        }
+    }
+}
+
+/***********************************************************
+   Streaming passes
+***********************************************************/
+
+void initStream(STREAM* st, int size, int pSize, char** patterns[4])
+{
+    int i;
+
+    st->size = size;
+    st->pSize = pSize;
+    st->nRing = (pSize > 3) ? pSize : 3;
+    st->nMatch = 0;
+    for (i = N; i <= W; i++){
+        st->patterns[i] = patterns[i];
+    }
+    //Windows are allocated by the first pass using their level
+    for (i = 0; i <= MAX_LEVELS; i++){
+        st->ring[i] = NULL;
+    }
+}
+
+void streamPass(STREAM* st, FILE* inf, char* scratch)
+{
+    int level, dir, r, width;
+    char* row;
+    long long t;
+
+    width = st->size + 2;
+    for (level = 0; level < st->nLevels; level++){
+        if (st->ring[level] == NULL){
+            st->ring[level] = (char**) malloc(sizeof(char*) * st->nRing);
+            if (st->ring[level] == NULL)
+                die(__LINE__);
+            st->ring[level][0] = (char*) malloc((size_t) width * st->nRing);
+            if (st->ring[level][0] == NULL)
+                die(__LINE__);
+            for (r = 1; r < st->nRing; r++){
+                st->ring[level][r] = st->ring[level][0] + (size_t) r * width;
+            }
+        }
+        for (dir = N; level < st->nSearch && dir <= W; dir++){
+            st->spool[level][dir] = scratchFile(scratch);
+        }
+        //Row 0 of every generation is the dead halo row
+        memset(st->ring[level][0], DEAD, width);
+        pushRow(st, level, 0);
+    }
+
+    for (r = 1; r <= st->size; r++){
+        t = wallClockTime();
+        row = st->ring[0][r % st->nRing];
+        readWorldRow(inf, row, st->size);
+        phaseTime[PHASE_LOAD] += wallClockTime() - t;
+        pushRow(st, 0, r);
+    }
+    memset(st->ring[0][(st->size + 1) % st->nRing], DEAD, width);
+    pushRow(st, 0, st->size + 1);
+}
+
+void pushRow(STREAM* st, int level, int r)
+{
+    char** ring;
+    int i, size;
+    long long t;
+
+    ring = st->ring[level];
+    size = st->size;
+    if (level < st->nSearch){
+        t = wallClockTime();
+        searchRow(st, level, r - st->pSize + 1);
+        phaseTime[PHASE_SEARCH] += wallClockTime() - t;
+    }
+
+    if (level == st->nLevels - 1){
+        //Only the written generation is not searched
+        if (st->out != NULL && r >= 1 && r <= size){
+            t = wallClockTime();
+            fwrite(&ring[r % st->nRing][1], 1, size, st->out);
+            fputc('\n', st->out);
+            phaseTime[PHASE_LOAD] += wallClockTime() - t;
+        }
+        return;
+    }
+
+    //Row i = r-1 of the next level has all of its neighbours now
+    i = r - 1;
+    if (i >= 1){
+        t = wallClockTime();
+        evolveRow(ring[(i - 1) % st->nRing], ring[i % st->nRing],
+            ring[r % st->nRing], st->ring[level + 1][i % st->nRing], size);
+        phaseTime[PHASE_EVOLVE] += wallClockTime() - t;
+        pushRow(st, level + 1, i);
+    }
+    if (r == size + 1){
+        memset(st->ring[level + 1][r % st->nRing], DEAD, size + 2);
+        pushRow(st, level + 1, r);
+    }
+}
+
+void searchRow(STREAM* st, int level, int top)
+{
+    char *rows[st->pSize], **pattern;
+    int dir, wCol, pRow, pCol, match, pSize, iteration;
+
+    pSize = st->pSize;
+    if (top < 1 || top > st->size - pSize + 1)
+        return;
+    for (pRow = 0; pRow < pSize; pRow++){
+        rows[pRow] = st->ring[level][(top + pRow) % st->nRing];
+    }
+
+    iteration = st->base + level;
+    for (dir = N; dir <= W; dir++){
+        pattern = st->patterns[dir];
+        for (wCol = 1; wCol <= (st->size - pSize + 1); wCol++){
+            match = 1;
+            for (pRow = 0; match && pRow < pSize; pRow++){
+                for (pCol = 0; match && pCol < pSize; pCol++){
+                    if (rows[pRow][wCol+pCol] != pattern[pRow][pCol])
+                        match = 0;
+                }
+            }
+            if (match){
+                fprintf(st->spool[level][dir], "%d:%d:%d:%d\n",
+                    iteration, top - 1, wCol - 1, dir);
+                st->nMatch++;
+            }
+        }
+    }
+}
+
+void flushSpools(STREAM* st, FILE* matches)
+{
+    char buf[1 << 16];
+    size_t n;
+    int level, dir;
+
+    for (level = 0; level < st->nSearch; level++){
+        for (dir = N; dir <= W; dir++){
+            rewind(st->spool[level][dir]);
+            while ((n = fread(buf, 1, sizeof(buf), st->spool[level][dir])) > 0){
+                fwrite(buf, 1, n, matches);
+            }
+            fclose(st->spool[level][dir]);
+        }
+    }
+}
@@ -3,18 +3,32 @@
 #else
 #define _XOPEN_SOURCE 500
 #endif /* __STDC_VERSION__ */
+#define _DEFAULT_SOURCE     //MAP_ANONYMOUS, MAP_HUGETLB and madvise
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <mpi.h>
+//The char kernel and the window compare use NEON on ARM (the Jetson
+//nodes), picked by the compiler's target; other targets stay scalar
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
 /*
 MPI Global Variables
 */
 int slaves;
 int myid;
+MPI_Comm workerComm;    //the slaves only, MPI_COMM_NULL on the master
+MPI_Comm ringComm;      //periodic 1-D Cartesian workerComm for --torus
 //#define DEBUG
 #define MASTER_ID slaves
 /***********************************************************
@@ -27,6 +41,143 @@ void die(int lineNo);
 //For trackinng execution
 long long wallClockTime();
 
+//For interval timing, not affected by clock adjustments
+long long monotonicTime();
+
+
+/***********************************************************
+   Phase timing, reported on stderr with --phases
+***********************************************************/
+
+#define PHASE_LOAD 0
+#define PHASE_EVOLVE 1
+#define PHASE_SEARCH 2
+#define PHASE_COMM 3
+#define PHASE_MERGE 4
+#define PHASE_PRINT 5
+//Breakdown of PHASE_COMM on the slaves
+#define PHASE_HALO_SEND 6
+#define PHASE_HALO_WAIT 7
+#define PHASE_TRANSFER 8
+#define PHASE_REBALANCE 9
+#define PHASE_CHECKPOINT 10
+#define NPHASES 11
+
+//Per-rank accumulated nanoseconds, indexed by PHASE_*
+long long phaseTime[NPHASES];
+
+//Close a phase opened at monotonicTime() "begin", also traces it
+void phaseEnd(int phase, long long begin);
+
+void printPhases(int size, int iterations, long long total);
+
+void reducePhases(long long minT[], long long sumT[], long long maxT[]);
+
+void printPhaseTable(long long minT[], long long sumT[], long long maxT[]);
+
+
+/***********************************************************
+   Timeline tracing with --trace=<file>
+***********************************************************/
+
+//Trace events are the PHASE_* ids followed by the traced MPI calls
+#define TRACE_MPI_SEND (NPHASES + 0)
+#define TRACE_MPI_RECV (NPHASES + 1)
+#define TRACE_MPI_REDUCE (NPHASES + 2)
+#define TRACE_MPI_ISEND (NPHASES + 3)
+#define TRACE_MPI_IRECV (NPHASES + 4)
+#define TRACE_MPI_WAITALL (NPHASES + 5)
+#define TRACE_MPI_GATHER (NPHASES + 6)
+#define TRACE_MPI_BCAST (NPHASES + 7)
+#define TRACE_MPI_ALLREDUCE (NPHASES + 8)
+#define TRACE_MPI_WAIT (NPHASES + 9)
+#define TRACE_MPI_TEST (NPHASES + 10)
+#define TRACE_MPI_BARRIER (NPHASES + 11)
+#define TRACE_MPI_FILE_OPEN (NPHASES + 12)
+#define TRACE_MPI_FILE_WRITE_AT (NPHASES + 13)
+#define TRACE_MPI_FILE_IWRITE_AT (NPHASES + 14)
+#define TRACE_MPI_FILE_READ_AT_ALL (NPHASES + 15)
+#define TRACE_MPI_FILE_SYNC (NPHASES + 16)
+#define TRACE_MPI_FILE_CLOSE (NPHASES + 17)
+#define TRACE_MPI_STARTALL (NPHASES + 18)
+#define TRACE_MPI_PUT (NPHASES + 19)
+#define TRACE_MPI_WIN_POST (NPHASES + 20)
+#define TRACE_MPI_WIN_START (NPHASES + 21)
+#define TRACE_MPI_WIN_COMPLETE (NPHASES + 22)
+#define TRACE_MPI_WIN_WAIT (NPHASES + 23)
+#define TRACE_MPI_WIN_FENCE (NPHASES + 24)
+#define NTRACE_EVENTS (NPHASES + 25)
+
+//Barrier rounds used to estimate the clock offset between ranks
+#define TRACE_SYNC_ROUNDS 9
+
+typedef struct {
+    int event;
+    long long begin, end;   //monotonicTime() of the recording rank
+} TRACEREC;
+
+//Per-rank ring buffer, the oldest records are overwritten when full
+typedef struct {
+    int enabled;
+    int capacity;
+    long long nRecord;      //total ever recorded, may exceed capacity
+    TRACEREC* record;
+    long long sync[TRACE_SYNC_ROUNDS];
+} TRACE;
+
+TRACE trace;
+
+void traceInit(int capacity);
+
+void traceRecord(int event, long long begin, long long end);
+
+void traceDump(char* fname);
+
+
+/***********************************************************
+   Command line options, parsed by every rank
+***********************************************************/
+
+typedef struct {
+    char* worldFile;
+    char* patternFile;
+    int iterations;
+    int showPhases;         //--phases
+    int rebalance;          //--rebalance=<n>, iterations between rebalancing
+    char* weightFile;       //--weights=<file>, per host band weights
+    int calibrate;          //--calibrate, weights from a timed evolveWorld
+    char* outputFile;       //--output=<file>, stream matches instead of a list
+    int binary;             //--binary, binary records for --output
+    int query;              //QUERY_*, see the match sinks
+    int queryArg;           //tile size or k of the query
+    char* traceFile;        //--trace=<file>, NULL when not tracing
+    int traceCapacity;      //--trace-events=<n>, records per rank
+    int fused;              //--fused[=<rows>], search and evolve in one pass
+    int stripRows;          //rows per fused strip, 0 sizes it to the cache
+    int tileCols;           //--tile=<cols>|auto, columns per fused tile,
+                            //0 untiled, TILE_AUTO tuned at startup
+    int kernel;             //--kernel=char|lut, KERNEL_* evolve kernel
+    int verify;             //--verify, check kernels against the scalar code
+    char* ruleText;         //--rule=B<n..>/S<n..>, parsed into rule
+    int torus;              //--torus, the world wraps around at its edges
+    int checkpoint;         //--checkpoint=<n>, iterations between checkpoints
+    char* checkpointFile;   //--checkpoint-file=<base>, writes <base>.0/.1
+    int restart;            //--restart, resume from the newest checkpoint
+    int cycles;             //--cycles, replay matches once the world repeats
+    int prefilter;          //--prefilter, reject windows by live cell counts
+    int matcher;            //--matcher=compiled|generic, window compare
+    int maxMismatch;        //--max-mismatch=<k>, cells a match may differ in
+    int track;              //--track, print trajectories instead of matches
+    int bbox;               //--bbox, evolve and search near live cells only
+    int pack;               //--pack[=rle], PACK_* halo encoding, 0 raw
+    int halo;               //--halo=blocking|persistent|rma|rma-fence,
+                            //HALO_* exchange
+} OPTIONS;
+
+OPTIONS opt;
+
+void parseOptions(int argc, char** argv);
+
 
 /***********************************************************
   Square matrix related functions, used by both world and pattern
@@ -54,10 +205,80 @@ void printSquareMatrix( char**, int size );
 
 char** readWorldFromFile( char* fname, int* size );
 
+//Opens a world file and reads its size, the rows follow
+FILE* openWorldFile( char* fname, int* size );
+
+//Reads the next row of the world file into columns 1..size of row, 
+//columns 0 and size+1 are set DEAD
+void readWorldRow( FILE* inf, char* row, int size );
+
+//Master only: reads the world row by row and sends every slave rows 
+//start-1..stop of its band.  Only the largest band is held at a time,
+//the rows shared with the next band are kept for it.
+void sendWorld( FILE* inf, int size, int pSize, int rows[], int tag );
+
 int countNeighbours(char** world, int row, int col);
 
 void evolveWorld(char** curWorld, char** nextWorld, int row, int col);
 
+//Rows fromRow..toRow, columns fromCol..toCol of nextWorld only, using
+//the kernel chosen by --kernel
+void evolveBlock(char** curWorld, char** nextWorld, int fromRow, int toRow,
+        int fromCol, int toCol);
+
+#define KERNEL_CHAR 0       //countNeighbours per cell, 16 cells with NEON
+#define KERNEL_LUT 1        //2x2 cells at a time from a 64K entry table, 
+                            //built from the rule
+
+//Outer-totalistic rule from --rule, B3/S23 by default.  A dead cell 
+//with n live neighbours is born when bit n of birth is set, a live one
+//survives when bit n of survive is set.
+typedef void (*EVOLVEFN)(char** curWorld, char** nextWorld, int fromRow, 
+        int toRow, int fromCol, int toCol);
+
+typedef struct {
+    int birth, survive;
+    EVOLVEFN kernel;        //char kernel, specialised for common rules
+} RULE;
+
+RULE rule;
+
+#define RULE_B2 0x004
+#define RULE_B3 0x008
+#define RULE_B36 0x048
+#define RULE_B3678 0x1c8
+#define RULE_S23 0x00c
+#define RULE_S34678 0x1d8
+
+//"B36/S23" style text, returns 0 when it is not a valid rule
+int parseRule(char* text, RULE* result);
+
+//The char kernel for rules without a specialised one
+void evolveGeneric(char** curWorld, char** nextWorld, int fromRow, 
+        int toRow, int fromCol, int toCol);
+
+//--verify: recomputes a block with the scalar rule, aborts on mismatch
+void verifyBlock(char** curWorld, char** nextWorld, int fromRow, 
+        int toRow, int fromCol, int toCol);
+
+void verifyFailed(char* what, int row, int col);
+
+//The table kernel packs every column of four rows into a nibble and 
+//looks the 4x4 neighbourhood of a 2x2 block up in lifeTable.  It only
+//needs bit 4 of a cell, which is set in ALIVE ('X') and clear in DEAD.
+#define CELL_BIT(c) (((c) >> 4) & 1)
+
+//Bit r of nibble c is the cell in row r, column c of the 4x4 window,
+//the index holds nibbles 0..3 from the top bits down.  Bits 0..3 of an
+//entry are the next state of (1,1), (1,2), (2,1) and (2,2).
+unsigned char lifeTable[1 << 16];
+int lifeTableReady;
+
+void buildLifeTable();
+
+void evolveBlockLUT(char** curWorld, char** nextWorld, int fromRow, 
+        int toRow, int fromCol, int toCol);
+
 
 /***********************************************************
    Simple circular linked list for match records
@@ -80,12 +301,68 @@ void deleteList( MATCHLIST*);
 
 void insertEnd(MATCHLIST*, int, int, int, int);
 
+//Moves every item of src to the end of list, src is left empty
+void appendList(MATCHLIST* list, MATCHLIST* src);
+
 void printList(MATCHLIST*);
 
-int matchToInt(MATCH *mat);
+//Match keys sort like the output: rotation, row, col within an iteration
+#define MATCH_KEY_BASE 100000ll
+
+long long matchToKey(MATCH *mat);
+
+long long* transferListToArr(MATCHLIST* list);
+void keyToMatch(long long key, int iteration, MATCH* mat);
+
+
+/***********************************************************
+   Streaming match writer for --output=<file>
+***********************************************************/
+
+//The master formats each iteration's matches into one of a few large
+//buffers, a background thread writes the full ones out, so memory
+//stays bounded and printing overlaps the slaves' next generation
+#define WRITER_BUFFERS 4
+#define WRITER_BUFFER_SIZE (4 << 20)
+#define WRITER_MAX_LINE 48
+#define WRITER_MAGIC "SETLMAT1"
 
-int* transferListToArr(MATCHLIST* list);
-MATCH* intToMatch(int index, int iteration);
+typedef struct {
+    FILE* outf;
+    int binary;
+    char* buf[WRITER_BUFFERS];
+    size_t len[WRITER_BUFFERS];
+    int fillIdx;            //buffer the master is filling
+    size_t fillLen;
+    int writeIdx;           //oldest buffer queued for the thread
+    int queued;
+    int closing;
+    int failed;             //set by the thread when a write fails
+    long long nMatch;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} WRITER;
+
+//"-" streams to stdout.  Binary files start with WRITER_MAGIC and the
+//world and pattern size as two ints.  A resumeAt >= 0 keeps that many
+//bytes of an existing file and appends after them.
+void writerOpen(WRITER* writer, char* fname, int binary, int size, int pSize,
+        long long resumeAt);
+
+//Waits until everything submitted is written, returns the file offset
+//or -1 when it cannot be told (stdout)
+long long writerSync(WRITER* writer);
+
+//Sorted match keys of one iteration, as sent by the slaves
+void writerIteration(WRITER* writer, int iteration, long long keys[], int nKey);
+
+//Flushes everything, returns the number of matches written
+long long writerClose(WRITER* writer);
+
+//The thread cannot take the other ranks down, the master aborts the
+//job once it sees a failed write
+void writerCheck(WRITER* writer);
 /***********************************************************
    Search related functions
 ***********************************************************/
@@ -96,62 +373,582 @@ MATCH* intToMatch(int index, int iteration);
 #define S 2 //180 degree clockwise
 #define W 3 //90 degree anti-clockwise
 #define MAX_FIND_ONCE 100000
+//Pattern cells are ALIVE, DEAD or WILDCARD, which matches either
 char** readPatternFromFile( char* fname, int* size );
 
 void rotate90(char** current, char** rotated, int size);
 
+#define WILDCARD '?'
+
+//Set once the patterns are known: a pattern with wildcards or a 
+//--max-mismatch above 0 needs searchBlockApprox
+int approxSearch;
+
+int hasWildcard(char** pattern, int pSize);
+
+
+/***********************************************************
+   Match sinks for the list and the aggregate query modes
+***********************************************************/
+
+//What the search does with a match, chosen by --count, 
+//--histogram=<tile> or --first-k=<k>.  Only QUERY_LIST keeps per-match
+//records, the others aggregate into counts and are combined with a
+//single MPI_Reduce at the end instead of per-iteration match lists.
+#define QUERY_LIST 0
+#define QUERY_COUNT 1       //counts[iteration]
+#define QUERY_HISTOGRAM 2   //counts[tile row * tilesPerRow + tile col]
+#define QUERY_FIRST_K 3     //counts[] = first k keys in output order
+
+typedef struct {
+    int mode;
+    MATCHLIST* list;
+    MATCHLIST* rotList[4];  //per rotation lists with --fused, --prefilter 
+                            //or --bbox, else NULL
+    int size;
+    int tile, tilesPerRow;
+    long long* counts;
+    long long nCount;
+    long long nFirst;
+    MATCHLIST* log;         //--cycles: aggregated matches also go here
+} MATCHSINK;
+
+void initSink(MATCHSINK* sink, int size, int iterations, MATCHLIST* list);
+
+void recordMatch(MATCHSINK* sink, int iteration, int row, int col,
+        int rotation);
+
+//True once more matches can no longer change the result
+int sinkFull(MATCHSINK* sink);
+
+//Orders matches like the output: iteration, rotation, row, col
+long long firstKey(int size, int iteration, int row, int col, int rotation);
+
+//Collective over MPI_COMM_WORLD, the totals end up on the master
+void reduceSink(MATCHSINK* sink);
+
+void printSink(MATCHSINK* sink);
+
+//Back to the identity of the reduction: zero counts, no first keys
+void resetSink(MATCHSINK* sink);
+
+//Appends the per rotation lists of a fused pass to sink->list, which
+//restores the rotation, row, col order of the unfused search
+void flushRotations(MATCHSINK* sink);
+
 void searchPatterns(char** world, int wRow, int wCol, int iteration, 
-        char** patterns[4], int pSize, MATCHLIST* list, int rowOffset);
+        char** patterns[4], int pSize, MATCHSINK* sink, int rowOffset);
 
 void searchSinglePattern(char** world, int wSizeRow, int wSizeCol, int interation,
-        char** pattern, int pSize, int rotation, MATCHLIST* list, int rowOffset);
+        char** pattern, int pSize, int rotation, MATCHSINK* sink, int rowOffset);
+
+//Matches whose top left cell is in rows fromRow..toRow, columns 
+//fromCol..toCol
+void searchBlock(char** world, int fromRow, int toRow, int fromCol, 
+        int toCol, int wSizeCol, int iteration, char** pattern, int pSize, 
+        int rotation, MATCHSINK* sink, int rowOffset);
+
+//searchBlock for all four rotations.  With --prefilter the block is
+//searched once by searchBlockPrefilter, else one rotation after another.
+void searchBlockRotations(char** world, int fromRow, int toRow, 
+        int fromCol, int toCol, int wSizeCol, int iteration, 
+        char** patterns[4], int pSize, MATCHSINK* sink, int rowOffset);
+
+//The four rotations with --prefilter.  A window can only match when its
+//live cell count and the count of each of its rows equal the pattern's,
+//both read in O(1) from a rolling integral image of the block's rows.
+//The image does not depend on the rotation, so it is built once and 
+//every rotation is tested against it.  Only the windows passing both 
+//are compared cell by cell.  The rotations' matches interleave, sink 
+//needs its rotList[] to keep the output order.
+void searchBlockPrefilter(char** world, int fromRow, int toRow, 
+        int fromCol, int toCol, int wSizeCol, int iteration, 
+        char** patterns[4], int pSize, MATCHSINK* sink, int rowOffset);
+
+//searchBlock for wildcards and --max-mismatch.  Rows of the block are
+//packed 64 cells to a word, so one XOR compares a pattern cell with 64
+//windows side by side.  Mismatches are counted per window in bit-sliced
+//"more than k" masks up to --max-mismatch, and wildcard cells are never
+//compared.  Patterns wider than 64 cells use windowMatches.
+void searchBlockApprox(char** world, int fromRow, int toRow, 
+        int fromCol, int toCol, int wSizeCol, int iteration, char** pattern,
+        int pSize, int rotation, MATCHSINK* sink, int rowOffset);
+
+#define APPROX_MAX_PSIZE 64
+
+//The scalar window compare, the reference for --verify.  At most
+//--max-mismatch of the non-wildcard cells may differ.
+int windowMatches(char** world, int wRow, int wCol, char** pattern, 
+        int pSize);
+
+/***********************************************************
+   Compiled window matchers with --matcher=compiled
+***********************************************************/
+
+//Once the pattern is read every rotation is compiled into a list of 
+//cell offsets from a window's top left cell and the values expected 
+//there, cells least likely to match first: live cells in a world that
+//is mostly dead and the other way round.  3x3, 4x4, 5x5 and 8x8 
+//patterns get fully unrolled compares of their list, other sizes keep
+//the generic loop over the pattern rows.
+#define MATCHER_GENERIC 0
+#define MATCHER_COMPILED 1
+#define MATCHER_MAX_CELLS 64
+#define MATCHER_CACHE 8     //compiled rotations kept
+
+typedef struct MATCHERSTRUCT {
+    char** pattern;         //the rotation compiled, NULL in an empty slot
+    long stride;            //distance between the world's rows
+    int nCell;
+    long offset[MATCHER_MAX_CELLS];
+    char value[MATCHER_MAX_CELLS];
+    int (*match)(const char* window, const struct MATCHERSTRUCT* m);
+} MATCHER;
+
+double liveDensity = 0.5;   //of this rank's first generation
+
+//The matcher of pattern for a world whose rows are stride apart, NULL 
+//when pSize has no unrolled compare or with --matcher=generic
+MATCHER* compileMatcher(char** pattern, int pSize, long stride);
+
+#ifdef HAVE_NEON
+//Compares 16 windows of row wRow at a time, in column order, and returns
+//the first column left to the scalar loop
+int searchRowNEON(char** world, int wRow, int fromCol, int toCol, 
+        int iteration, char** pattern, int pSize, int rotation, 
+        MATCHSINK* sink, int row);
+#endif
 
 int min(int a, int b){
     if (a < b) return a; else return b;
 }
 
+int max(int a, int b){
+    if (a > b) return a; else return b;
+}
+
+/***********************************************************
+   Row band related functions
+***********************************************************/
+
+//Slave's share of the world.  Local row 0 is the halo row above, local
+//rows 1..rows are owned and the pSize-1 rows below them are halo rows
+//needed by the search.  Rows past the world's bottom halo row (global
+//row size+1) are not stored.
+//
+//With --torus the halo rows wrap around to the other edge and are always
+//stored.  Column 0 then mirrors column size and the columns after size
+//mirror columns 1.., enough for evolve and for windows across the seam.
+//
+//With --bbox the live cells of every stored row r of cur lie in columns 
+//lo[r]..hi[r], lo[r] > hi[r] when the row is dead, and likewise for next.
+typedef struct {
+    int start;          //global row of local row 1
+    int rows;           //owned rows
+    int nRows;          //stored rows, halos included
+    int size;           //world size
+    int width;          //size + 2, size + max(pSize, 2) with --torus
+    char **cur, **next;
+    int *lo, *hi;       //--bbox live spans of cur, NULL otherwise
+    int *nextLo, *nextHi;
+} BAND;
+
+//Split size rows over parts bands in proportion to weights, NULL
+//weights split evenly
+void partitionRows(int size, int parts, double weights[], int rows[]);
+
+//Collective over MPI_COMM_WORLD: initial rows of every band, weighted
+//by --weights or --calibrate when given
+void planPartition(int size, int pSize, int rows[]);
+
+//This rank's weight from a --weights file
+double hostWeight(char* fname);
+
+//This rank's weight from timing evolveWorld on a synthetic band
+double calibrateWeight(int size);
+
+#define CALIBRATE_ROWS 32
+#define CALIBRATE_WIDTH 2048
+#define CALIBRATE_NS 50000000ll
+
+void allocateBand(BAND* band, int start, int rows, int size, int pSize);
+
+void freeBand(BAND* band);
+
+//Cells of a band matrix, width x rows filled with DEAD.  Bands of a 
+//huge page or more are mapped on huge pages when the system has them
+//reserved, otherwise transparent huge pages are asked for.
+char** allocateBandMatrix(int width, int rows);
+
+void freeBandMatrix(char** matrix, int width, int rows);
+
+#define BAND_HUGE_BYTES (2 << 20)
+
+//Refresh the halo rows of band->cur from the neighbouring slaves
+void exchangeHalo(BAND* band, int pSize, int iteration);
+
+//--torus: halo rows from the up and down neighbours on ringComm, the
+//first and last slaves being neighbours, then the wrapped columns
+void exchangeHaloRing(BAND* band, int pSize);
+
+//--halo=persistent: the halo exchange is set up once as persistent 
+//requests on fixed buffers and started every generation.  Messages 
+//keep their size, so dead rows under --bbox are sent as well.  The 
+//neighbours and sizes do not change when rebalancing.
+//
+//--halo=rma and --halo=rma-fence: the fixed receive buffers are exposed
+//in a window instead and the neighbours MPI_Put their rows into it, in
+//post-start-complete-wait epochs with just the two neighbours, or in
+//fence epochs over all slaves.
+//
+//--torus --pack with the blocking exchange keeps its packed message
+//buffers in the plan as well, without requests or a window.
+#define HALO_BLOCKING 0
+#define HALO_PERSISTENT 1
+#define HALO_RMA 2
+#define HALO_RMA_FENCE 3
+
+typedef struct {
+    int ready;
+    int up, down;           //neighbours, MPI_PROC_NULL at the world edges
+    int nUp, nDown;         //bytes of the messages to up and to down
+    char *toUp, *toDown, *fromUp, *fromDown;
+    MPI_Request req[4];
+    MPI_Win win;            //fromUp then fromDown, the RMA modes only
+    MPI_Group neighbours;
+} HALOPLAN;
+
+HALOPLAN haloPlan;
+
+void exchangeHaloPersistent(BAND* band, int pSize);
+
+void exchangeHaloRMA(BAND* band, int pSize);
+
+void haloPlanInit(HALOPLAN* plan, int size, int pSize);
+
+void haloPlanFree(HALOPLAN* plan);
+
+//Halo rows first..first+n-1 of band->cur to or from a message buffer
+void haloRowsOut(BAND* band, int first, int n, char* buffer);
+
+void haloRowsIn(BAND* band, int first, int n, char* buffer);
+
+//--torus --pack: exchangeHaloRing with packed messages
+void exchangeHaloRingPacked(BAND* band, int pSize);
+
+//--torus: column 0 and the columns after size from the other edge
+void wrapColumns(BAND* band);
+
+#define HALO_UP_TAG 2       //first owned rows, to the band above
+#define HALO_DOWN_TAG 3     //last owned row, to the band below
+
+//--pack: halo rows travel as 1 bit per cell.  A message is a format 
+//byte then the bits of its rows, or with --pack=rle the bits as runs of
+//zero bytes and literal bytes when that is shorter.
+#define PACK_BITS 1
+#define PACK_RLE 2
+#define PACK_MAX_BYTES(n, size) (1 + (n) * (((size) + 7) / 8))
+
+//Pack columns 1..size of n rows into out, returns the message bytes
+int packHalo(char** rows, int n, int size, unsigned char* out);
+
+//Unpack a message of packHalo into columns 1..size of n rows
+void unpackHalo(unsigned char* in, int bytes, char** rows, int n, int size);
+
+//--bbox: live spans of every row of band->cur from a scan, next must be
+//all dead
+void initSpans(BAND* band);
+
+//Columns lo..hi of from..to holding the row's live cells, lo > hi when
+//there are none
+void rowSpan(char* row, int from, int to, int* lo, int* hi);
+
+//--bbox: evolve the owned rows of band->cur into band->next, each row
+//only one column around the live spans of it and its neighbour rows
+void evolveSpans(BAND* band);
+
+//--bbox: searchPatterns over windows holding a live cell of band->cur.
+//Patterns without live cells, or matches with mismatches, are searched
+//everywhere.
+void searchSpans(BAND* band, int iteration, char** patterns[4], int pSize,
+        MATCHSINK* sink);
+
+//--bbox: the spans follow band->cur and band->next when they are swapped
+void swapSpans(BAND* band);
+
+//Collective over workerComm: move band boundaries towards equal busy
+//time, busy being this band's search + evolve time since the last call
+void rebalanceBand(BAND* band, long long busy, int pSize);
+
+//Searches generation t and evolves it into band->next in one sweep of 
+//stripRows row strips, so each strip is still cached when evolved.
+//Strips are walked in tiles of tileCols columns when tileCols > 0.
+//Matches are not searched when search is 0.
+void fusedPass(BAND* band, int iteration, char** patterns[4], int pSize,
+        MATCHSINK* sink, int search, int stripRows, int tileCols);
+
+//Strip height keeping a strip's cur and next rows within this many bytes
+//when the cache size is unknown, otherwise half of the L2 cache is used
+#define FUSED_STRIP_BYTES (128 << 10)
+
+//Strip height for strips or tiles width cells wide
+int fusedStripRows(int width, int pSize);
+
+//Tile width with the fastest evolve on the first rows of this band, 0 
+//when untiled wins.  Tried widths are doubled from TILE_MIN_COLS.
+int autotuneTile(BAND* band, int pSize);
+
+#define TILE_AUTO -1
+#define TILE_MIN_COLS 64
+#define TILE_TUNE_ROWS 64
+#define TILE_TUNE_REPS 2
+
+//Skip rebalancing while the slowest band is within 5% of the fastest
+#define REBALANCE_TOLERANCE 0.05
+#define REBALANCE_TAG 1
+
 int sortFunction( const void *a, const void *b);
+
+
+/***********************************************************
+   Checkpoint and restart with --checkpoint=<n> and --restart
+***********************************************************/
+
+//Every n iterations the world and the match state so far are written
+//with MPI-IO to <base>.0 and <base>.1 in turn, so the previous 
+//checkpoint stays intact while the next one is written.  A file is
+//the header, the size x size cells row by row, then the master's match
+//state.  The rows do not depend on the bands, so a run can restart on
+//a different number of ranks.
+#define CKPT_MAGIC "SETLCKP1"
+#define CKPT_HEADER_BYTES 128
+
+typedef struct {
+    char magic[8];
+    int size, pSize;
+    int iteration;          //next iteration to search
+    int query, queryArg;
+    int complete;           //written last, once every rank's data is in
+    long long nState;       //list records, counts, or --output bytes
+    long long nMatch;       //--output: matches already written
+} CKPTHEADER;
+
+//The write in flight.  Each rank writes a private copy of its data, so
+//the generation loop goes on while the write completes.
+typedef struct {
+    int active;
+    MPI_File fh;
+    MPI_Request req;
+    char* buf;
+    CKPTHEADER header;      //master only
+} CHECKPOINT;
+
+CHECKPOINT ckpt;
+
+//Collective over MPI_COMM_WORLD at the start of an iteration: completes
+//the previous checkpoint and starts writing this one.  Slaves pass their
+//band, the master its list, sink and writer (NULL without --output).
+//The aggregate sinks are folded into the master's at every checkpoint.
+void checkpointBegin(int iteration, int pSize, BAND* band, MATCHLIST* list, 
+        MATCHSINK* sink, WRITER* writer);
+
+//Lets an active write progress, never blocks
+void checkpointPoll();
+
+//Collective: waits for the active write and marks its file complete
+void checkpointFinish();
+
+//Master only: index of the newest complete checkpoint file and its
+//header, -1 when there is none
+int checkpointLatest(CKPTHEADER* header);
+
+//Master only: restores the list or sink saved with header
+void checkpointReadState(int index, CKPTHEADER* header, MATCHLIST* list,
+        MATCHSINK* sink);
+
+//Collective: the owned rows of band from checkpoint file index, the 
+//master passes NULL.  Halo rows are left to the caller.
+void checkpointReadBand(int index, BAND* band);
+
+void checkpointName(char* name, int index);
+
+//n elements of unit as count elements of type, for writes past INT_MAX
+//elements: one element of chunks of CKPT_CHUNK then the rest.  Returns
+//the count.
+int checkpointType(long long n, MPI_Datatype unit, MPI_Datatype* type);
+
+#define CKPT_CHUNK (1 << 30)
+
+/***********************************************************
+   Trajectory tracking with --track
+***********************************************************/
+
+//A moving pattern such as a glider reappears every period iterations,
+//moved by (dRow, dCol).  Both are found at startup by evolving each
+//rotation alone on an empty board.  The master links every match to
+//the match period iterations earlier at its predecessor's position, 
+//looked up in a hash of that iteration's matches, and prints one
+//record per trajectory instead of one line per match:
+//  start iteration:start row:start col:rotation:length
+//A pattern that never reappears within TRACK_MAX_PERIOD generations is
+//linked as a still life, period 1 and no displacement.
+#define TRACK_MAX_PERIOD 8
+#define TRACK_SLOTS (TRACK_MAX_PERIOD + 1)
+
+typedef struct {
+    int period, dRow, dCol;
+} MOTION;
+
+typedef struct {
+    int iteration, row, col, rotation;  //first match
+    int length;                         //matches linked, period apart
+} TRACK;
+
+typedef struct {
+    MOTION motion[4];
+    TRACK* track;
+    long long nTrack, trackCap;
+    //open addressing tables of match key -> track of the last 
+    //TRACK_SLOTS iterations, the iteration held in slot iteration % SLOTS
+    long long* key[TRACK_SLOTS];
+    long long* id[TRACK_SLOTS];
+    int capacity[TRACK_SLOTS];
+    int iteration[TRACK_SLOTS];
+} TRACKER;
+
+//Period and displacement of pattern under the rule
+void patternMotion(char** pattern, int pSize, MOTION* motion);
+
+void initTracker(TRACKER* tracker, char** patterns[4], int pSize);
+
+//Links the n sorted match keys of iteration to their trajectories
+void trackIteration(TRACKER* tracker, int iteration, long long* keys, 
+        int n);
+
+void printTracks(TRACKER* tracker);
+
+
+/***********************************************************
+   Cycle detection with --cycles
+***********************************************************/
+
+//Zobrist hashing: the world's hash is the XOR of a fixed random key per
+//live cell.  Each slave keeps the hash of its owned cells up to date 
+//from the cells evolve changed, and the world hash is their XOR 
+//allreduce over workerComm.  Once the world at iteration i equals the 
+//world at iteration j < i, iteration k >= i repeats iteration 
+//j + (k - j) % (i - j), so slaves replay the matches kept for it 
+//instead of evolving and searching.  The master sees no difference.
+//
+//Two worlds are taken as equal when both their hashes and their live
+//cell counts agree.  A 64-bit collision between different worlds of the
+//same population is not ruled out, it would replay wrong matches, but 
+//at about 2^-64 per comparison it is not expected in practice.
+#define CYCLE_HISTORY 16    //iterations kept, the longest period found
+
+typedef struct {
+    unsigned long long hash;                //owned cells of the band
+    long long live;                         //live owned cells
+    unsigned long long world[CYCLE_HISTORY];    //world hash by slot
+    long long worldLive[CYCLE_HISTORY];     //world live cells by slot
+    int iteration[CYCLE_HISTORY];           //iteration of a slot, or -1
+    long long* keys[CYCLE_HISTORY];         //match keys of the iteration
+    int nKeys[CYCLE_HISTORY];
+    int from, period;       //the repeated iteration j and i - j, 0 before
+} CYCLE;
+
+void cycleInit(CYCLE* cycle, BAND* band);
+
+void cycleFree(CYCLE* cycle);
+
+//Key of a global cell, the same on every rank
+unsigned long long cellKey(int row, int col);
+
+//XOR of the keys of the live owned cells of band->cur, their number in
+//live
+unsigned long long bandHash(BAND* band, long long* live);
+
+//XOR of the keys of the owned cells that differ between band->cur and
+//band->next, applied to the hash of cur it gives the hash of next.  The
+//change in live cells is added to live.
+unsigned long long hashChanges(BAND* band, long long* live);
+
+//Collective over workerComm until a cycle is found: true when the world
+//at iteration repeats an earlier one
+int cycleFound(CYCLE* cycle, int iteration);
+
+//Keeps the n match keys of iteration, keys is freed by the cycle
+void cycleKeep(CYCLE* cycle, int iteration, long long* keys, int n);
+
+//Match keys of iteration once a cycle is found, owned by the cycle
+long long* cycleReplay(CYCLE* cycle, int iteration, int* n);
+
 /***********************************************************
    Main function
 ***********************************************************/
 
-int masterWork(int argc, char** argv){
-    char **curW, **nextW, **temp, dummy[20];
+int masterWork(){
+    FILE* worldFile = NULL;
     char **patterns[4];
     int dir, iterations, iter;
     int size, patternSize;
-    long long before, after;
-    MATCHLIST* list, *tmpList;
+    long long before, after, t;
+    long long minT[NPHASES], sumT[NPHASES], maxT[NPHASES];
+    MATCHLIST* list;
+    MATCHSINK sink;
+    WRITER writer;
+    TRACKER tracker;
+    long long *iterArr = NULL;
+    int nIter, iterCap = 0;
     MPI_Status Stat;
     int sendTag = 0;
-    if (argc < 4 ){
-        fprintf(stderr, 
-            "Usage: %s <world file> <Iterations> <pattern file>\n", argv[0]);
-        exit(1);
-    } 
-
-    curW = readWorldFromFile(argv[1], &size);
-    nextW = allocateSquareMatrix(size+2, DEAD);
+    int startIter = 0, ckptIndex = -1;
+    CKPTHEADER header;
+
+    t = monotonicTime();
+    if (opt.restart){
+        //the world comes from the checkpoint, straight to the slaves
+        ckptIndex = checkpointLatest(&header);
+        if (ckptIndex < 0){
+            fprintf(stderr, "No complete checkpoint %s.0 or %s.1\n", 
+                opt.checkpointFile, opt.checkpointFile);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        size = header.size;
+        startIter = header.iteration;
+    } else 
+        worldFile = openWorldFile(opt.worldFile, &size);
+    if (size >= MATCH_KEY_BASE)
+        die(__LINE__);
+    phaseEnd(PHASE_LOAD, t);
 
     //Start timer
     before = wallClockTime();
 
     printf("World Size = %d\n", size);
 
-    iterations = atoi(argv[2]);
+    iterations = opt.iterations;
     printf("Iterations = %d\n", iterations);
 
-    patterns[N] = readPatternFromFile(argv[3], &patternSize);
+    patterns[N] = readPatternFromFile(opt.patternFile, &patternSize);
     for (dir = E; dir <= W; dir++){
         patterns[dir] = allocateSquareMatrix(patternSize, DEAD);
         rotate90(patterns[dir-1], patterns[dir], patternSize);
     }
     printf("Pattern size = %d\n", patternSize);
+    if (opt.restart && (header.pSize != patternSize 
+            || header.query != opt.query || header.queryArg != opt.queryArg)){
+        fprintf(stderr, "Checkpoint was taken with another pattern size or"
+            " query mode\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (opt.track)
+        initTracker(&tracker, patterns, patternSize);
 
     /*Send size and iteration information all slaves*/
-    int basicInfo[3] = {size, iterations, patternSize};
+    int basicInfo[5] = {size, iterations, patternSize, startIter, ckptIndex};
     for (int i = 0; i < slaves; i++){
-        MPI_Send(basicInfo, 3, MPI_INT, i, sendTag, MPI_COMM_WORLD);
+        MPI_Send(basicInfo, 5, MPI_INT, i, sendTag, MPI_COMM_WORLD);
     }
 
 
@@ -170,43 +967,71 @@ int masterWork(int argc, char** argv){
     
     sendTag++;
     int responsibleRows[slaves];
-    for (int i = 0; i < slaves; i++){
-        responsibleRows[i] = size / slaves;
-        if (i < size % slaves) responsibleRows[i]++;
-    }
-    int currentRow = 1; //Start from row 1 as row 0 is meaningless
-    for (int i = 0; i < slaves; i++){
-        int stopRow = min(currentRow + responsibleRows[i] -1 + patternSize-1, size+1); //stops at size row as this is the last meaningful row
-        int tmpSize = (stopRow - currentRow +2) * (size+2);
-        MPI_Send(curW[currentRow-1], tmpSize, MPI_CHAR, i, sendTag, MPI_COMM_WORLD);
-        currentRow += responsibleRows[i];
+    planPartition(size, patternSize, responsibleRows);
+    if (!opt.restart){
+        t = monotonicTime();
+        sendWorld(worldFile, size, patternSize, responsibleRows, sendTag);
+        fclose(worldFile);
+        phaseEnd(PHASE_LOAD, t);
     }
 
 
+    if (opt.restart)
+        checkpointReadBand(ckptIndex, NULL);
 
     //Actual work start
     list = newList();
-    for (iter = 0; iter < iterations; iter++){
-        tmpList = newList();
+    initSink(&sink, size, iterations, list);
+    if (opt.restart)
+        checkpointReadState(ckptIndex, &header, list, &sink);
+    if (opt.outputFile != NULL){
+        writerOpen(&writer, opt.outputFile, opt.binary, size, patternSize,
+            opt.restart ? header.nState : -1);
+        if (opt.restart)
+            writer.nMatch = header.nMatch;
+    }
+    for (iter = startIter; iter < iterations; iter++){
+        if (opt.checkpoint > 0 && iter % opt.checkpoint == 0 
+                && iter > startIter)
+            checkpointBegin(iter, patternSize, NULL, list, &sink, 
+                opt.outputFile != NULL ? &writer : NULL);
+        //The aggregate query modes send nothing until the final reduction
+        if (sink.mode != QUERY_LIST)
+            continue;
+        nIter = 0;
         for (int i = 0; i < slaves; i++){
             int matchSize;
             MPI_Recv(&matchSize, 1, MPI_INT, i, iter, MPI_COMM_WORLD, &Stat);
-            int* matchArr = (int *) malloc(sizeof(int) * matchSize);
-            MPI_Recv(matchArr, matchSize, MPI_INT, i, iter, MPI_COMM_WORLD, &Stat);
-            for (int j = 0; j < matchSize; j++){
-                MATCH *newMatch = intToMatch(matchArr[j], iter);
-                insertEnd(tmpList, newMatch->iteration, newMatch->row, newMatch->col, newMatch->rotation);
+            if (nIter + matchSize > iterCap){
+                iterCap = 2 * (nIter + matchSize);
+                iterArr = (long long*) realloc(iterArr, 
+                    sizeof(long long) * iterCap);
+                if (iterArr == NULL)
+                    die(__LINE__);
             }
+            MPI_Recv(iterArr + nIter, matchSize, MPI_LONG_LONG, i, iter, MPI_COMM_WORLD, &Stat);
+            nIter += matchSize;
+        }
+        t = monotonicTime();
+        qsort((void *)iterArr, nIter, sizeof(long long), sortFunction);
+        if (opt.track){
+            trackIteration(&tracker, iter, iterArr, nIter);
+        } else if (opt.outputFile == NULL){
+            for (int j = 0; j < nIter; j++){
+                MATCH newMatch;
+                keyToMatch(iterArr[j], iter, &newMatch);
+                insertEnd(list, newMatch.iteration, newMatch.row, newMatch.col, newMatch.rotation);
+            }
+        }
+        phaseEnd(PHASE_MERGE, t);
+        if (opt.outputFile != NULL){
+            t = monotonicTime();
+            writerIteration(&writer, iter, iterArr, nIter);
+            phaseEnd(PHASE_PRINT, t);
         }
-        int* tmpArr = transferListToArr(tmpList);
-
-        qsort((void *)tmpArr, tmpList->nItem, sizeof(int), sortFunction);
-        for (int j = 0; j < tmpList->nItem; j++){
-            MATCH *newMatch = intToMatch(tmpArr[j], iter);
-            insertEnd(list, newMatch->iteration, newMatch->row, newMatch->col, newMatch->rotation);
-            
-        }            
     }
+    free(iterArr);
+    checkpointFinish();
 //     for (iter = 0; iter < iterations; iter++){
 
 // #ifdef DEBUG
@@ -224,7 +1049,22 @@ int masterWork(int argc, char** argv){
 //     }
 
 
-    printList( list );
+    if (sink.mode != QUERY_LIST){
+        t = monotonicTime();
+        reduceSink(&sink);
+        phaseEnd(PHASE_MERGE, t);
+    }
+
+    t = monotonicTime();
+    if (sink.mode != QUERY_LIST)
+        printSink(&sink);
+    else if (opt.outputFile != NULL)
+        printf("List size = %lld\n", writerClose(&writer));
+    else if (opt.track)
+        printTracks(&tracker);
+    else
+        printList( list );
+    phaseEnd(PHASE_PRINT, t);
 
     //Stop timer
     after = wallClockTime();
@@ -232,13 +1072,20 @@ int masterWork(int argc, char** argv){
     printf("Parallel SETL took %1.2f seconds\n", 
         ((float)(after - before))/1000000000);
 
+    //Evolve, search and comm happen on the slaves, report the slowest one
+    reducePhases(minT, sumT, maxT);
+    phaseTime[PHASE_EVOLVE] = maxT[PHASE_EVOLVE];
+    phaseTime[PHASE_SEARCH] = maxT[PHASE_SEARCH];
+    phaseTime[PHASE_COMM] = maxT[PHASE_COMM];
+    if (opt.showPhases){
+        printPhases(size, iterations, after - before);
+        printPhaseTable(minT, sumT, maxT);
+    }
+
 
 //     //Clean up
 //     deleteList( list );
 
-//     freeSquareMatrix( curW );
-//     freeSquareMatrix( nextW );
-
 //     freeSquareMatrix( patterns[0] );
 //     freeSquareMatrix( patterns[1] );
 //     freeSquareMatrix( patterns[2] );
@@ -248,20 +1095,27 @@ int masterWork(int argc, char** argv){
 
 int slaveWork(){
     char **patterns[4];
-    int basicInfo[3];
-    int size, patternSize, iterations;
+    int basicInfo[5];
+    int size, patternSize, iterations, startIter, ckptIndex;
     int receiveTag = 0;
-    char **curW, **nextW, **temp;
+    char **temp;
+    long long t;
     MPI_Status status;
     MATCHLIST* list;
+    MATCHSINK sink;
+    BAND band;
+    CYCLE cycle;
 
 
 
     list = newList();
-    MPI_Recv(basicInfo, 3, MPI_INT, MASTER_ID, receiveTag, MPI_COMM_WORLD, &status);
+    t = monotonicTime();
+    MPI_Recv(basicInfo, 5, MPI_INT, MASTER_ID, receiveTag, MPI_COMM_WORLD, &status);
     size = basicInfo[0];
     iterations = basicInfo[1];
     patternSize = basicInfo[2];
+    startIter = basicInfo[3];
+    ckptIndex = basicInfo[4];
 #ifdef DEBUG
     printf("Slave node %d received size = %d iterations = %d patternSize = %d\n", myid, size, iterations, patternSize);
 #endif
@@ -272,6 +1126,7 @@ int slaveWork(){
         MPI_Recv(tmpChars[i], patternSize * patternSize, MPI_CHAR, MASTER_ID, receiveTag, MPI_COMM_WORLD, &status);
         patterns[i] = allocateSquareMatrixNoEmpty(patternSize, tmpChars[i]);
     }
+    approxSearch = opt.maxMismatch > 0 || hasWildcard(patterns[N], patternSize);
 #ifdef DEBUG
     printf("Slave node %d received four pattern matrix\n", myid);
     printSquareMatrix(patterns[N], patternSize);
@@ -282,121 +1137,233 @@ int slaveWork(){
     
     receiveTag++;
     int responsibleRows[slaves];
-    for (int i = 0; i < slaves; i++){
-        responsibleRows[i] = size / slaves;
-        if (i < size % slaves) responsibleRows[i]++;
-    }
+    planPartition(size, patternSize, responsibleRows);
     int currentRow = 1; //Start from row 1 as row 0 is meaningless
-    char matrixInfo[(responsibleRows[myid] + patternSize) * (size+2)];
-    int myRowNumber;
-    int rowOffset;
-    for (int i = 0; i < slaves; i++){
-        int stopRow = min(currentRow + responsibleRows[i] -1 + patternSize-1, size+1); //stops at size row as this is the last meaningful row
-        int tmpSize = (stopRow - currentRow +2) * (size+2);
-        if (i == myid){
-            MPI_Recv(matrixInfo, tmpSize, MPI_CHAR, MASTER_ID, receiveTag, MPI_COMM_WORLD, &status);
-            myRowNumber = stopRow - currentRow +2;
-            rowOffset = currentRow - 1;
-            break;
-        }
+    for (int i = 0; i < myid; i++){
         currentRow += responsibleRows[i];
     }
-    curW = allocateMatrixNoEmpty((size + 2), myRowNumber, matrixInfo);
-    nextW = allocateMatrix((size + 2), myRowNumber, DEAD);
+    allocateBand(&band, currentRow, responsibleRows[myid], size, patternSize);
+    //The master sends rows of size+2 up to its bottom halo row, torus 
+    //bands are wider and get their wrapped halos from the neighbours
+    if (opt.restart){
+        checkpointReadBand(ckptIndex, &band);
+        if (!opt.torus)
+            exchangeHalo(&band, patternSize, startIter);
+    } else {
+        MPI_Datatype rowType;
+        MPI_Type_vector(min(band.nRows, size + 3 - band.start), size + 2, 
+            band.width, MPI_CHAR, &rowType);
+        MPI_Type_commit(&rowType);
+        MPI_Recv(band.cur[0], 1, rowType, MASTER_ID, receiveTag, MPI_COMM_WORLD, &status);
+        MPI_Type_free(&rowType);
+    }
+    if (opt.torus)
+        exchangeHaloRing(&band, patternSize);
+    phaseEnd(PHASE_COMM, t);
+    if (opt.bbox)
+        initSpans(&band);
 #ifdef DEBUG
-    for (int i = 1; i < myRowNumber; i++){
+    for (int i = 1; i < band.nRows; i++){
         for (int j = 1; j <= size; j++){
-            printf("%c",curW[i][j]);
+            printf("%c",band.cur[i][j]);
         }
         printf("\n");
     }
 #endif
     //searchPatterns( curW, myRowNumber-1, size, 0, patterns, patternSize, list, rowOffset);
     //printList(list);
-    int sendTag = 0;
-    for (int i = 0; i< iterations; i++){
-        searchPatterns( curW, myRowNumber-1, size, i, patterns, patternSize, list, rowOffset);
-        evolveWorld(curW, nextW, myRowNumber-2, size);
-        temp = curW;
-        curW = nextW;
-        nextW = temp;
-        char buffer[size];
+    initSink(&sink, size, iterations, list);
+    long long nLive = 0;
+    for (int r = 1; r <= band.rows; r++){
+        for (int c = 1; c <= size; c++){
+            nLive += (band.cur[r][c] == ALIVE);
+        }
+    }
+    if (band.rows > 0)
+        liveDensity = (double) nLive / ((double) band.rows * size);
+    int stripRows = 0, tileCols = 0;
+    if (opt.fused){
+        t = monotonicTime();
+        tileCols = opt.tileCols;
+        if (tileCols == TILE_AUTO)
+            tileCols = autotuneTile(&band, patternSize);
+        stripRows = opt.stripRows > 0 ? opt.stripRows 
+            : fusedStripRows(tileCols > 0 ? tileCols : size, patternSize);
+        phaseEnd(PHASE_LOAD, t);
+        if (opt.showPhases && opt.tileCols != 0)
+            fprintf(stderr, "TILE rank=%d cols=%d rows=%d\n", myid, 
+                tileCols, stripRows);
+    }
+    if ((opt.fused || opt.prefilter || opt.bbox) && sink.mode == QUERY_LIST){
+        for (int dir = N; dir <= W; dir++){
+            sink.rotList[dir] = newList();
+        }
+    }
+    if (opt.cycles){
+        t = monotonicTime();
+        cycleInit(&cycle, &band);
+        if (sink.mode != QUERY_LIST)
+            sink.log = newList();
+        phaseEnd(PHASE_EVOLVE, t);
+    }
+    long long lastBusy = 0;
+    for (int i = startIter; i< iterations; i++){
+        if (opt.checkpoint > 0 && i % opt.checkpoint == 0 && i > startIter)
+            checkpointBegin(i, patternSize, &band, list, &sink, NULL);
+        if (opt.cycles && cycleFound(&cycle, i)){
+            int nKeys;
+            long long* keys = cycleReplay(&cycle, i, &nKeys);
+            t = monotonicTime();
+            if (sink.mode == QUERY_LIST){
+                MPI_Send(&nKeys, 1, MPI_INT, MASTER_ID , i, MPI_COMM_WORLD);
+                MPI_Send(keys, nKeys, MPI_LONG_LONG, MASTER_ID , i, MPI_COMM_WORLD);
+            } else {
+                for (int k = 0; k < nKeys; k++){
+                    MATCH mat;
+                    keyToMatch(keys[k], i, &mat);
+                    recordMatch(&sink, i, mat.row, mat.col, mat.rotation);
+                }
+            }
+            phaseEnd(PHASE_TRANSFER, t);
+            continue;
+        }
+        if (opt.fused){
+            fusedPass(&band, i, patterns, patternSize, &sink, 
+                !sinkFull(&sink), stripRows, tileCols);
+            flushRotations(&sink);
+        } else if (opt.bbox){
+            t = monotonicTime();
+            if (!sinkFull(&sink))
+                searchSpans(&band, i, patterns, patternSize, &sink);
+            flushRotations(&sink);
+            phaseEnd(PHASE_SEARCH, t);
+            t = monotonicTime();
+            evolveSpans(&band);
+            phaseEnd(PHASE_EVOLVE, t);
+        } else {
+            t = monotonicTime();
+            if (!sinkFull(&sink))
+                searchPatterns( band.cur, band.nRows-1, size, i, patterns, patternSize, &sink, band.start-1);
+            flushRotations(&sink);
+            phaseEnd(PHASE_SEARCH, t);
+            t = monotonicTime();
+            evolveWorld(band.cur, band.next, band.nRows-2, size);
+            phaseEnd(PHASE_EVOLVE, t);
+        }
+        if (opt.cycles){
+            t = monotonicTime();
+            cycle.hash ^= hashChanges(&band, &cycle.live);
+            phaseEnd(PHASE_EVOLVE, t);
+        }
+        temp = band.cur;
+        band.cur = band.next;
+        band.next = temp;
+        if (opt.bbox)
+            swapSpans(&band);
 #ifdef DEBUG
         if (myid == 1 && i == 1){
             printf("world is like!\n");
-            for (int q = 0; q < myRowNumber; q++){
+            for (int q = 0; q < band.nRows; q++){
                 for (int p = 1; p <= size; p++){
-                    printf("%c", curW[q][p]);
+                    printf("%c", band.cur[q][p]);
                 }
                 printf("\n");
             }
         } 
 #endif
-        if (myid != 0){
-            for (int j = 0; j < patternSize-1; j++){
-                for (int k = 1; k <= size; k++){
-                    buffer[k-1] = curW[j+1][k];
-                }
-                MPI_Send(buffer, size, MPI_CHAR, myid - 1, i * size + myid +j, MPI_COMM_WORLD);
-            }
+        exchangeHalo(&band, patternSize, i);
 
+        /*After evolve, transfer the information to neighbours*/
+        if (sink.mode == QUERY_LIST){
+            t = monotonicTime();
+            long long *matchArr = transferListToArr(list);
+            int matchSize = list->nItem;
+            MPI_Send(&matchSize, 1, MPI_INT, MASTER_ID , i, MPI_COMM_WORLD);
+            MPI_Send(matchArr, list->nItem, MPI_LONG_LONG, MASTER_ID , i, MPI_COMM_WORLD);
+            phaseEnd(PHASE_TRANSFER, t);
+            if (opt.cycles)
+                cycleKeep(&cycle, i, matchArr, matchSize);
+            else
+                free(matchArr);
+            deleteList(list);
+            list = newList();    
+            sink.list = list;
+        } else if (opt.cycles){
+            cycleKeep(&cycle, i, transferListToArr(sink.log), 
+                sink.log->nItem);
+            deleteList(sink.log);
+            sink.log = newList();
         }
-        if (myid != slaves-1){
-            for (int k = 1; k <= size; k++){
-                buffer[k-1] = curW[myRowNumber - patternSize][k];
-            }
-            MPI_Send(buffer, size, MPI_CHAR, myid + 1, i * size +myid, MPI_COMM_WORLD);
-        }
-        if (myid != 0){
-            MPI_Recv(buffer, size, MPI_CHAR, myid - 1, i * size + (myid-1), MPI_COMM_WORLD,&status);
 
-            for (int k = 1; k <= size; k++){
-                curW[0][k] = buffer[k-1];
-            }
+        if (opt.rebalance > 0 && (i+1) % opt.rebalance == 0 && i+1 < iterations){
+            long long busy = phaseTime[PHASE_SEARCH] + phaseTime[PHASE_EVOLVE];
+            rebalanceBand(&band, busy - lastBusy, patternSize);
+            lastBusy = busy;
+            if (opt.cycles)
+                cycle.hash = bandHash(&band, &cycle.live);
         }
-
-        if (myid != slaves-1){
-            for (int j = 0; j < patternSize-1; j++){
-                MPI_Recv(buffer, size, MPI_CHAR, myid + 1, i * size + (myid+1) + j, MPI_COMM_WORLD, &status);
-                for (int k = 1; k <= size; k++){
-                    curW[j + myRowNumber - patternSize +1][k] = buffer[k-1];
-                }
-            }            
-        }
-        // if (myid == 1 && i == 1){
-        //     printf("world after change!\n");
-        //     for (int q = 0; q < myRowNumber; q++){
-        //         for (int p = 1; p <= size; p++){
-        //             printf("%c", curW[q][p]);
-        //         }
-        //         printf("\n");
-        //     }
-        // } 
-
-        /*After evolve, transfer the information to neighbours*/
-        int *matchArr = transferListToArr(list);
-        int matchSize = list->nItem;
-        MPI_Send(&matchSize, 1, MPI_INT, MASTER_ID , i, MPI_COMM_WORLD);
-        MPI_Send(matchArr, list->nItem, MPI_INT, MASTER_ID , i, MPI_COMM_WORLD);
-        list = newList();    
+        checkpointPoll();
     }
+    checkpointFinish();
+    haloPlanFree(&haloPlan);
     //printList(list);
 
+    if (opt.cycles){
+        cycleFree(&cycle);
+        if (sink.log != NULL)
+            deleteList(sink.log);
+        sink.log = NULL;
+    }
+    freeBand(&band);
+    for (int dir = N; dir <= W; dir++){
+        if (sink.rotList[dir] != NULL)
+            deleteList(sink.rotList[dir]);
+    }
+    if (sink.mode != QUERY_LIST){
+        t = monotonicTime();
+        reduceSink(&sink);
+        phaseEnd(PHASE_TRANSFER, t);
+    }
+    phaseTime[PHASE_COMM] += phaseTime[PHASE_HALO_SEND] 
+        + phaseTime[PHASE_HALO_WAIT] + phaseTime[PHASE_TRANSFER]
+        + phaseTime[PHASE_REBALANCE];
+    reducePhases(NULL, NULL, NULL);
+
 }
 
 int main( int argc, char** argv)
 {
-    int nprocs;
-    MPI_Init(&argc,&argv);
+    int nprocs, provided;
+    //Only the main thread calls MPI, the match writer thread does not
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
     MPI_Comm_rank(MPI_COMM_WORLD, &myid);
     slaves = nprocs - 1;
+    if (provided < MPI_THREAD_FUNNELED){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "The match writer thread needs an MPI library"
+                " with MPI_THREAD_FUNNELED\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    MPI_Comm_split(MPI_COMM_WORLD, myid == MASTER_ID ? MPI_UNDEFINED : 0,
+        myid, &workerComm);
+    parseOptions(argc, argv);
+    if (opt.torus && workerComm != MPI_COMM_NULL){
+        int dims[1] = {slaves}, periods[1] = {1};
+        MPI_Cart_create(workerComm, 1, dims, periods, 0, &ringComm);
+    }
+    if (opt.traceFile != NULL)
+        traceInit(opt.traceCapacity);
+
     if (myid == MASTER_ID){
-        masterWork(argc, argv);
+        masterWork();
     }else{
         slaveWork();
     }
     
+    if (opt.traceFile != NULL)
+        traceDump(opt.traceFile);
     MPI_Finalize();
     return 0;
 }
@@ -425,30 +1392,842 @@ long long wallClockTime( )
 #endif
 }
 
-/***********************************************************
-  Square matrix related functions, used by both world and pattern
-***********************************************************/
-
-char** allocateSquareMatrix( int size, char defaultValue )
+void parseOptions(int argc, char** argv)
 {
+    int i, nQueries = 0;
 
-    char* contiguous;
-    char** matrix;
-    int i;
-
-    //Using a least compiler version dependent approach here
-    //C99, C11 have a nicer syntax.    
-    contiguous = (char*) malloc(sizeof(char) * size * size);
-    if (contiguous == NULL) 
-        die(__LINE__);
-
-
-    memset(contiguous, defaultValue, size * size );
+    if (argc < 4 ){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "Usage: %s <world file> <Iterations> <pattern file>"
+                " [--phases] [--trace=<file>] [--trace-events=<n>]"
+                " [--rebalance=<n>] [--weights=<file> | --calibrate]"
+                " [--output=<file> [--binary]]"
+                " [--count | --histogram=<tile> | --first-k=<k>]"
+                " [--fused[=<rows>]] [--tile=<cols> | --tile=auto]"
+                " [--kernel=char|lut] [--verify] [--rule=B3/S23]"
+                " [--torus] [--checkpoint=<n>] [--checkpoint-file=<base>]"
+                " [--restart] [--cycles] [--prefilter]"
+                " [--matcher=compiled|generic] [--max-mismatch=<k>]"
+                " [--track] [--bbox] [--pack[=rle]]"
+                " [--halo=blocking|persistent|rma|rma-fence]\n",
+                argv[0]);
+        MPI_Finalize();
+        exit(1);
+    } 
 
-    //Point the row array to the right place
-    matrix = (char**) malloc(sizeof(char*) * size );
-    if (matrix == NULL) 
-        die(__LINE__);
+    opt.worldFile = argv[1];
+    opt.iterations = atoi(argv[2]);
+    opt.patternFile = argv[3];
+    opt.showPhases = 0;
+    opt.traceFile = NULL;
+    opt.outputFile = NULL;
+    opt.binary = 0;
+    opt.query = QUERY_LIST;
+    opt.queryArg = 0;
+    opt.traceCapacity = 1 << 16;
+    opt.rebalance = 0;
+    opt.weightFile = NULL;
+    opt.calibrate = 0;
+    opt.fused = 0;
+    opt.stripRows = 0;
+    opt.tileCols = 0;
+    opt.kernel = KERNEL_CHAR;
+    opt.verify = 0;
+    opt.ruleText = "B3/S23";
+    opt.torus = 0;
+    opt.checkpoint = 0;
+    opt.checkpointFile = "SETL_par.ckpt";
+    opt.restart = 0;
+    opt.cycles = 0;
+    opt.prefilter = 0;
+    opt.matcher = MATCHER_COMPILED;
+    opt.maxMismatch = 0;
+    opt.track = 0;
+    opt.bbox = 0;
+    opt.pack = 0;
+    opt.halo = HALO_BLOCKING;
+
+    for (i = 4; i < argc; i++){
+        if (strcmp(argv[i], "--phases") == 0){
+            opt.showPhases = 1;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0){
+            opt.traceFile = argv[i] + 8;
+        } else if (strncmp(argv[i], "--trace-events=", 15) == 0){
+            opt.traceCapacity = atoi(argv[i] + 15);
+            if (opt.traceCapacity <= 0)
+                die(__LINE__);
+        } else if (strncmp(argv[i], "--rebalance=", 12) == 0){
+            opt.rebalance = atoi(argv[i] + 12);
+        } else if (strncmp(argv[i], "--weights=", 10) == 0){
+            opt.weightFile = argv[i] + 10;
+        } else if (strcmp(argv[i], "--calibrate") == 0){
+            opt.calibrate = 1;
+        } else if (strncmp(argv[i], "--output=", 9) == 0){
+            opt.outputFile = argv[i] + 9;
+        } else if (strcmp(argv[i], "--binary") == 0){
+            opt.binary = 1;
+        } else if (strcmp(argv[i], "--count") == 0){
+            opt.query = QUERY_COUNT;
+            nQueries++;
+        } else if (strncmp(argv[i], "--histogram=", 12) == 0){
+            opt.query = QUERY_HISTOGRAM;
+            opt.queryArg = atoi(argv[i] + 12);
+            nQueries++;
+        } else if (strncmp(argv[i], "--first-k=", 10) == 0){
+            opt.query = QUERY_FIRST_K;
+            opt.queryArg = atoi(argv[i] + 10);
+            nQueries++;
+        } else if (strcmp(argv[i], "--fused") == 0){
+            opt.fused = 1;
+        } else if (strncmp(argv[i], "--fused=", 8) == 0){
+            opt.fused = 1;
+            opt.stripRows = atoi(argv[i] + 8);
+            if (opt.stripRows <= 0)
+                die(__LINE__);
+        } else if (strcmp(argv[i], "--tile=auto") == 0){
+            opt.fused = 1;
+            opt.tileCols = TILE_AUTO;
+        } else if (strncmp(argv[i], "--tile=", 7) == 0){
+            opt.fused = 1;
+            opt.tileCols = atoi(argv[i] + 7);
+            if (opt.tileCols <= 0)
+                die(__LINE__);
+        } else if (strcmp(argv[i], "--kernel=char") == 0){
+            opt.kernel = KERNEL_CHAR;
+        } else if (strcmp(argv[i], "--kernel=lut") == 0){
+            opt.kernel = KERNEL_LUT;
+        } else if (strcmp(argv[i], "--verify") == 0){
+            opt.verify = 1;
+        } else if (strncmp(argv[i], "--rule=", 7) == 0){
+            opt.ruleText = argv[i] + 7;
+        } else if (strcmp(argv[i], "--rule") == 0 && i + 1 < argc){
+            opt.ruleText = argv[++i];
+        } else if (strcmp(argv[i], "--torus") == 0){
+            opt.torus = 1;
+        } else if (strncmp(argv[i], "--checkpoint=", 13) == 0){
+            opt.checkpoint = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--checkpoint-file=", 18) == 0){
+            opt.checkpointFile = argv[i] + 18;
+        } else if (strcmp(argv[i], "--restart") == 0){
+            opt.restart = 1;
+        } else if (strcmp(argv[i], "--cycles") == 0){
+            opt.cycles = 1;
+        } else if (strcmp(argv[i], "--prefilter") == 0){
+            opt.prefilter = 1;
+        } else if (strcmp(argv[i], "--matcher=compiled") == 0){
+            opt.matcher = MATCHER_COMPILED;
+        } else if (strcmp(argv[i], "--matcher=generic") == 0){
+            opt.matcher = MATCHER_GENERIC;
+        } else if (strncmp(argv[i], "--max-mismatch=", 15) == 0){
+            opt.maxMismatch = atoi(argv[i] + 15);
+        } else if (strcmp(argv[i], "--max-mismatch") == 0 && i + 1 < argc){
+            opt.maxMismatch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--track") == 0){
+            opt.track = 1;
+        } else if (strcmp(argv[i], "--bbox") == 0){
+            opt.bbox = 1;
+        } else if (strcmp(argv[i], "--pack") == 0){
+            opt.pack = PACK_BITS;
+        } else if (strcmp(argv[i], "--pack=rle") == 0){
+            opt.pack = PACK_RLE;
+        } else if (strcmp(argv[i], "--halo=blocking") == 0){
+            opt.halo = HALO_BLOCKING;
+        } else if (strcmp(argv[i], "--halo=persistent") == 0){
+            opt.halo = HALO_PERSISTENT;
+        } else if (strcmp(argv[i], "--halo=rma") == 0){
+            opt.halo = HALO_RMA;
+        } else if (strcmp(argv[i], "--halo=rma-fence") == 0){
+            opt.halo = HALO_RMA_FENCE;
+        } else {
+            if (myid == MASTER_ID)
+                fprintf(stderr, "Unknown option %s\n", argv[i]);
+            MPI_Finalize();
+            exit(1);
+        }
+    }
+
+    if (!parseRule(opt.ruleText, &rule)){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "Bad rule %s, expected e.g. B36/S23\n", 
+                opt.ruleText);
+        MPI_Finalize();
+        exit(1);
+    }
+    if (opt.torus && opt.rebalance > 0){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "--rebalance does not support --torus\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (opt.maxMismatch < 0){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "--max-mismatch needs k >= 0\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (opt.track && (opt.query != QUERY_LIST || opt.outputFile != NULL
+            || opt.checkpoint > 0 || opt.restart)){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "--track does not take a query mode, --output"
+                " or checkpoints\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (opt.bbox && (opt.fused || opt.torus || (rule.birth & 1))){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "--bbox does not support --fused, --torus or"
+                " rules with B0\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (opt.halo != HALO_BLOCKING && opt.pack == PACK_RLE){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "--halo=persistent and rma send fixed size"
+                " messages, use --pack instead of --pack=rle\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (opt.cycles && opt.checkpoint > 0){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "--cycles does not support --checkpoint\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (opt.binary && opt.outputFile == NULL){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "--binary needs --output=<file>\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (nQueries > 1){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "--count, --histogram and --first-k are"
+                " exclusive, give only one\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (opt.query != QUERY_LIST && (opt.outputFile != NULL 
+            || (opt.query != QUERY_COUNT && opt.queryArg <= 0))){
+        if (myid == MASTER_ID)
+            fprintf(stderr, "Query modes need a positive tile or k and"
+                " do not take --output\n");
+        MPI_Finalize();
+        exit(1);
+    }
+}
+
+long long monotonicTime( )
+{
+#ifdef __linux__
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (long long)(tp.tv_nsec + (long long)tp.tv_sec * 1000000000ll);
+#else
+    return wallClockTime();
+#endif
+}
+
+void phaseEnd(int phase, long long begin)
+{
+    long long end;
+
+    end = monotonicTime();
+    phaseTime[phase] += end - begin;
+    if (trace.enabled)
+        traceRecord(phase, begin, end);
+}
+
+//One machine readable line for bench.sh, all times in seconds.
+//cells_per_sec counts cell generations over the timed region
+//minus printing, so it is comparable across output modes.
+void printPhases(int size, int iterations, long long total)
+{
+    long long compute;
+
+    compute = total - phaseTime[PHASE_PRINT];
+    if (compute <= 0) compute = 1;
+
+    fprintf(stderr, "PHASES load=%.6f evolve=%.6f search=%.6f comm=%.6f"
+        " merge=%.6f print=%.6f total=%.6f cells_per_sec=%.0f\n",
+        phaseTime[PHASE_LOAD] / 1e9, phaseTime[PHASE_EVOLVE] / 1e9,
+        phaseTime[PHASE_SEARCH] / 1e9, phaseTime[PHASE_COMM] / 1e9,
+        phaseTime[PHASE_MERGE] / 1e9, phaseTime[PHASE_PRINT] / 1e9,
+        total / 1e9, (double)size * size * iterations / (compute / 1e9));
+}
+
+//Collective over MPI_COMM_WORLD: min/sum/max of every slave's phaseTime
+//end up on the master.  Slaves pass NULLs, the master contributes the
+//identity of each operation so it does not skew the result.
+void reducePhases(long long minT[], long long sumT[], long long maxT[])
+{
+    int i;
+
+    if (myid != MASTER_ID){
+        MPI_Reduce(phaseTime, NULL, NPHASES, MPI_LONG_LONG, MPI_MIN,
+            MASTER_ID, MPI_COMM_WORLD);
+        MPI_Reduce(phaseTime, NULL, NPHASES, MPI_LONG_LONG, MPI_SUM,
+            MASTER_ID, MPI_COMM_WORLD);
+        MPI_Reduce(phaseTime, NULL, NPHASES, MPI_LONG_LONG, MPI_MAX,
+            MASTER_ID, MPI_COMM_WORLD);
+        return;
+    }
+
+    for (i = 0; i < NPHASES; i++){
+        minT[i] = LLONG_MAX;
+        sumT[i] = 0;
+        maxT[i] = 0;
+    }
+    MPI_Reduce(MPI_IN_PLACE, minT, NPHASES, MPI_LONG_LONG, MPI_MIN,
+        MASTER_ID, MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE, sumT, NPHASES, MPI_LONG_LONG, MPI_SUM,
+        MASTER_ID, MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE, maxT, NPHASES, MPI_LONG_LONG, MPI_MAX,
+        MASTER_ID, MPI_COMM_WORLD);
+}
+
+//Load imbalance shows up as max/avg well above 1 for search/evolve,
+//communication stalls as a large halo_wait on the ranks that wait.
+void printPhaseTable(long long minT[], long long sumT[], long long maxT[])
+{
+    static const int rows[] = {PHASE_SEARCH, PHASE_EVOLVE, PHASE_HALO_SEND,
+        PHASE_HALO_WAIT, PHASE_TRANSFER, PHASE_REBALANCE, PHASE_COMM,
+        PHASE_CHECKPOINT};
+    static const char* names[] = {"search", "evolve", "halo_send",
+        "halo_wait", "transfer", "rebalance", "comm", "checkpoint"};
+    int i, p;
+    double avg;
+
+    fprintf(stderr, "%-10s %10s %10s %10s %8s\n",
+        "phase", "min(s)", "avg(s)", "max(s)", "max/avg");
+    for (i = 0; i < (int) (sizeof(rows) / sizeof(rows[0])); i++){
+        p = rows[i];
+        avg = (double)sumT[p] / slaves;
+        fprintf(stderr, "%-10s %10.4f %10.4f %10.4f %8.2f\n", names[i],
+            minT[p] / 1e9, avg / 1e9, maxT[p] / 1e9,
+            avg > 0 ? maxT[p] / avg : 1.0);
+    }
+}
+
+/***********************************************************
+   Timeline tracing with --trace=<file>
+***********************************************************/
+
+void traceInit(int capacity)
+{
+    int i;
+
+    trace.record = (TRACEREC*) malloc(sizeof(TRACEREC) * capacity);
+    if (trace.record == NULL)
+        die(__LINE__);
+    trace.capacity = capacity;
+    trace.nRecord = 0;
+
+    //Every rank leaves the same barrier at nearly the same moment, so
+    //the difference of the local exit times estimates the clock offset.
+    //Several rounds are kept and the median taken in traceDump.
+    for (i = 0; i < TRACE_SYNC_ROUNDS; i++){
+        PMPI_Barrier(MPI_COMM_WORLD);
+        trace.sync[i] = monotonicTime();
+    }
+    trace.enabled = 1;
+}
+
+void traceRecord(int event, long long begin, long long end)
+{
+    TRACEREC* rec;
+
+    rec = &trace.record[trace.nRecord % trace.capacity];
+    rec->event = event;
+    rec->begin = begin;
+    rec->end = end;
+    trace.nRecord++;
+}
+
+int compareLongLong( const void *a, const void *b)
+{
+    long long x = *(long long*)a, y = *(long long*)b;
+
+    return (x > y) - (x < y);
+}
+
+//Collective over MPI_COMM_WORLD.  Every rank's ring buffer is gathered
+//on the master, shifted onto the master's clock and written out as one
+//Chrome trace (chrome://tracing, Perfetto), one process row per rank.
+void traceDump(char* fname)
+{
+    static const char* eventName[NTRACE_EVENTS] = {"load", "evolve",
+        "search", "comm", "merge", "print", "halo_send", "halo_wait",
+        "transfer", "rebalance", "checkpoint", "MPI_Send", "MPI_Recv", 
+        "MPI_Reduce",
+        "MPI_Isend", "MPI_Irecv", "MPI_Waitall", "MPI_Gather", "MPI_Bcast",
+        "MPI_Allreduce", "MPI_Wait", "MPI_Test", "MPI_Barrier", 
+        "MPI_File_open", "MPI_File_write_at", "MPI_File_iwrite_at",
+        "MPI_File_read_at_all", "MPI_File_sync", "MPI_File_close",
+        "MPI_Startall", "MPI_Put", "MPI_Win_post", "MPI_Win_start",
+        "MPI_Win_complete", "MPI_Win_wait", "MPI_Win_fence"};
+    int nprocs, nKept, first, i, r, k;
+    int *counts = NULL, *displs = NULL;
+    long long *syncs = NULL, offset, base, diff[TRACE_SYNC_ROUNDS];
+    TRACEREC *kept, *all = NULL, *rec;
+    FILE* outf;
+
+    trace.enabled = 0;
+    nprocs = slaves + 1;
+
+    //Unroll the ring so the records go out oldest first
+    nKept = trace.nRecord < trace.capacity ? trace.nRecord : trace.capacity;
+    kept = (TRACEREC*) malloc(sizeof(TRACEREC) * (nKept + 1));
+    if (kept == NULL)
+        die(__LINE__);
+    first = trace.nRecord < trace.capacity ? 0 
+        : trace.nRecord % trace.capacity;
+    for (i = 0; i < nKept; i++){
+        kept[i] = trace.record[(first + i) % trace.capacity];
+    }
+
+    if (myid == MASTER_ID){
+        counts = (int*) malloc(sizeof(int) * nprocs);
+        displs = (int*) malloc(sizeof(int) * nprocs);
+        syncs = (long long*) malloc(sizeof(long long) 
+            * nprocs * TRACE_SYNC_ROUNDS);
+        if (counts == NULL || displs == NULL || syncs == NULL)
+            die(__LINE__);
+    }
+    PMPI_Gather(trace.sync, TRACE_SYNC_ROUNDS, MPI_LONG_LONG,
+        syncs, TRACE_SYNC_ROUNDS, MPI_LONG_LONG, MASTER_ID, MPI_COMM_WORLD);
+
+    //Records travel as bytes, all our nodes share the same layout
+    nKept *= sizeof(TRACEREC);
+    PMPI_Gather(&nKept, 1, MPI_INT, counts, 1, MPI_INT, 
+        MASTER_ID, MPI_COMM_WORLD);
+    if (myid == MASTER_ID){
+        displs[0] = 0;
+        for (r = 1; r < nprocs; r++){
+            displs[r] = displs[r-1] + counts[r-1];
+        }
+        all = (TRACEREC*) malloc(displs[nprocs-1] + counts[nprocs-1] + 1);
+        if (all == NULL)
+            die(__LINE__);
+    }
+    PMPI_Gatherv(kept, nKept, MPI_BYTE, all, counts, displs, MPI_BYTE,
+        MASTER_ID, MPI_COMM_WORLD);
+    free(kept);
+
+    if (myid != MASTER_ID)
+        return;
+
+    outf = fopen(fname, "w");
+    if (outf == NULL)
+        die(__LINE__);
+
+    base = syncs[MASTER_ID * TRACE_SYNC_ROUNDS];
+    fprintf(outf, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (r = 0; r < nprocs; r++){
+        for (k = 0; k < TRACE_SYNC_ROUNDS; k++){
+            diff[k] = syncs[r * TRACE_SYNC_ROUNDS + k] 
+                - syncs[MASTER_ID * TRACE_SYNC_ROUNDS + k];
+        }
+        qsort(diff, TRACE_SYNC_ROUNDS, sizeof(long long), compareLongLong);
+        offset = diff[TRACE_SYNC_ROUNDS / 2];
+
+        fprintf(outf, "{\"name\": \"process_name\", \"ph\": \"M\", "
+            "\"pid\": %d, \"args\": {\"name\": \"%s %d\"}},\n",
+            r, r == MASTER_ID ? "master" : "slave", r);
+        rec = (TRACEREC*) ((char*) all + displs[r]);
+        for (i = 0; i < counts[r] / (int)sizeof(TRACEREC); i++){
+            fprintf(outf, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                "\"pid\": %d, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f},\n",
+                eventName[rec[i].event], 
+                rec[i].event < NPHASES ? "phase" : "mpi", r,
+                (rec[i].begin - offset - base) / 1e3,
+                (rec[i].end - rec[i].begin) / 1e3);
+        }
+    }
+    //Closing metadata record avoids a trailing comma
+    fprintf(outf, "{\"name\": \"clock_sync\", \"ph\": \"M\", \"pid\": %d, "
+        "\"args\": {\"rounds\": %d}}\n]}\n", MASTER_ID, TRACE_SYNC_ROUNDS);
+    fclose(outf);
+
+    free(all);
+    free(counts);
+    free(displs);
+    free(syncs);
+}
+
+/***********************************************************
+   MPI profiling wrappers, record every MPI call while tracing
+***********************************************************/
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest,
+        int tag, MPI_Comm comm)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Send(buf, count, datatype, dest, tag, comm);
+    begin = monotonicTime();
+    ret = PMPI_Send(buf, count, datatype, dest, tag, comm);
+    traceRecord(TRACE_MPI_SEND, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source,
+        int tag, MPI_Comm comm, MPI_Status *status)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Recv(buf, count, datatype, source, tag, comm, status);
+    begin = monotonicTime();
+    ret = PMPI_Recv(buf, count, datatype, source, tag, comm, status);
+    traceRecord(TRACE_MPI_RECV, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count,
+        MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Reduce(sendbuf, recvbuf, count, datatype, op, root, comm);
+    begin = monotonicTime();
+    ret = PMPI_Reduce(sendbuf, recvbuf, count, datatype, op, root, comm);
+    traceRecord(TRACE_MPI_REDUCE, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Isend(const void *buf, int count, MPI_Datatype datatype, int dest,
+        int tag, MPI_Comm comm, MPI_Request *request)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Isend(buf, count, datatype, dest, tag, comm, request);
+    begin = monotonicTime();
+    ret = PMPI_Isend(buf, count, datatype, dest, tag, comm, request);
+    traceRecord(TRACE_MPI_ISEND, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source,
+        int tag, MPI_Comm comm, MPI_Request *request)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Irecv(buf, count, datatype, source, tag, comm, request);
+    begin = monotonicTime();
+    ret = PMPI_Irecv(buf, count, datatype, source, tag, comm, request);
+    traceRecord(TRACE_MPI_IRECV, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[])
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Waitall(count, requests, statuses);
+    begin = monotonicTime();
+    ret = PMPI_Waitall(count, requests, statuses);
+    traceRecord(TRACE_MPI_WAITALL, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Startall(int count, MPI_Request requests[])
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Startall(count, requests);
+    begin = monotonicTime();
+    ret = PMPI_Startall(count, requests);
+    traceRecord(TRACE_MPI_STARTALL, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Gather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+        void *recvbuf, int recvcount, MPI_Datatype recvtype, int root,
+        MPI_Comm comm)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+            recvtype, root, comm);
+    begin = monotonicTime();
+    ret = PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+        recvtype, root, comm);
+    traceRecord(TRACE_MPI_GATHER, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root,
+        MPI_Comm comm)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Bcast(buffer, count, datatype, root, comm);
+    begin = monotonicTime();
+    ret = PMPI_Bcast(buffer, count, datatype, root, comm);
+    traceRecord(TRACE_MPI_BCAST, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
+        MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+    begin = monotonicTime();
+    ret = PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+    traceRecord(TRACE_MPI_ALLREDUCE, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Wait(request, status);
+    begin = monotonicTime();
+    ret = PMPI_Wait(request, status);
+    traceRecord(TRACE_MPI_WAIT, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Test(MPI_Request *request, int *flag, MPI_Status *status)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Test(request, flag, status);
+    begin = monotonicTime();
+    ret = PMPI_Test(request, flag, status);
+    traceRecord(TRACE_MPI_TEST, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Barrier(MPI_Comm comm)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Barrier(comm);
+    begin = monotonicTime();
+    ret = PMPI_Barrier(comm);
+    traceRecord(TRACE_MPI_BARRIER, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_File_open(MPI_Comm comm, const char *filename, int amode, 
+        MPI_Info info, MPI_File *fh)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_File_open(comm, filename, amode, info, fh);
+    begin = monotonicTime();
+    ret = PMPI_File_open(comm, filename, amode, info, fh);
+    traceRecord(TRACE_MPI_FILE_OPEN, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_File_write_at(MPI_File fh, MPI_Offset offset, const void *buf,
+        int count, MPI_Datatype datatype, MPI_Status *status)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_File_write_at(fh, offset, buf, count, datatype, status);
+    begin = monotonicTime();
+    ret = PMPI_File_write_at(fh, offset, buf, count, datatype, status);
+    traceRecord(TRACE_MPI_FILE_WRITE_AT, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_File_iwrite_at(MPI_File fh, MPI_Offset offset, const void *buf,
+        int count, MPI_Datatype datatype, MPI_Request *request)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_File_iwrite_at(fh, offset, buf, count, datatype, 
+            request);
+    begin = monotonicTime();
+    ret = PMPI_File_iwrite_at(fh, offset, buf, count, datatype, request);
+    traceRecord(TRACE_MPI_FILE_IWRITE_AT, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_File_read_at_all(MPI_File fh, MPI_Offset offset, void *buf, 
+        int count, MPI_Datatype datatype, MPI_Status *status)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_File_read_at_all(fh, offset, buf, count, datatype, 
+            status);
+    begin = monotonicTime();
+    ret = PMPI_File_read_at_all(fh, offset, buf, count, datatype, status);
+    traceRecord(TRACE_MPI_FILE_READ_AT_ALL, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_File_sync(MPI_File fh)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_File_sync(fh);
+    begin = monotonicTime();
+    ret = PMPI_File_sync(fh);
+    traceRecord(TRACE_MPI_FILE_SYNC, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_File_close(MPI_File *fh)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_File_close(fh);
+    begin = monotonicTime();
+    ret = PMPI_File_close(fh);
+    traceRecord(TRACE_MPI_FILE_CLOSE, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Put(const void *origin_addr, int origin_count, 
+        MPI_Datatype origin_datatype, int target_rank, MPI_Aint target_disp,
+        int target_count, MPI_Datatype target_datatype, MPI_Win win)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Put(origin_addr, origin_count, origin_datatype, 
+            target_rank, target_disp, target_count, target_datatype, win);
+    begin = monotonicTime();
+    ret = PMPI_Put(origin_addr, origin_count, origin_datatype, target_rank,
+        target_disp, target_count, target_datatype, win);
+    traceRecord(TRACE_MPI_PUT, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Win_post(MPI_Group group, int assert, MPI_Win win)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Win_post(group, assert, win);
+    begin = monotonicTime();
+    ret = PMPI_Win_post(group, assert, win);
+    traceRecord(TRACE_MPI_WIN_POST, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Win_start(MPI_Group group, int assert, MPI_Win win)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Win_start(group, assert, win);
+    begin = monotonicTime();
+    ret = PMPI_Win_start(group, assert, win);
+    traceRecord(TRACE_MPI_WIN_START, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Win_complete(MPI_Win win)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Win_complete(win);
+    begin = monotonicTime();
+    ret = PMPI_Win_complete(win);
+    traceRecord(TRACE_MPI_WIN_COMPLETE, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Win_wait(MPI_Win win)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Win_wait(win);
+    begin = monotonicTime();
+    ret = PMPI_Win_wait(win);
+    traceRecord(TRACE_MPI_WIN_WAIT, begin, monotonicTime());
+    return ret;
+}
+
+int MPI_Win_fence(int assert, MPI_Win win)
+{
+    long long begin;
+    int ret;
+
+    if (!trace.enabled)
+        return PMPI_Win_fence(assert, win);
+    begin = monotonicTime();
+    ret = PMPI_Win_fence(assert, win);
+    traceRecord(TRACE_MPI_WIN_FENCE, begin, monotonicTime());
+    return ret;
+}
+
+/***********************************************************
+  Square matrix related functions, used by both world and pattern
+***********************************************************/
+
+char** allocateSquareMatrix( int size, char defaultValue )
+{
+
+    char* contiguous;
+    char** matrix;
+    int i;
+
+    //Using a least compiler version dependent approach here
+    //C99, C11 have a nicer syntax.    
+    contiguous = (char*) malloc(sizeof(char) * size * size);
+    if (contiguous == NULL) 
+        die(__LINE__);
+
+
+    memset(contiguous, defaultValue, size * size );
+
+    //Point the row array to the right place
+    matrix = (char**) malloc(sizeof(char*) * size );
+    if (matrix == NULL) 
+        die(__LINE__);
 
     matrix[0] = contiguous;
     for (i = 1; i < size; i++){
@@ -565,17 +2344,11 @@ char** readWorldFromFile( char* fname, int* sizePtr )
 {
     FILE* inf;
     
-    char temp, **world;
-    int i, j;
+    char **world;
+    int i;
     int size;
 
-    inf = fopen(fname,"r");
-    if (inf == NULL)
-        die(__LINE__);
-
-
-    fscanf(inf, "%d", &size);
-    fscanf(inf, "%c", &temp);
+    inf = openWorldFile(fname, &size);
     
     //Using the "halo" approach
     // allocated additional top + bottom rows
@@ -584,55 +2357,1999 @@ char** readWorldFromFile( char* fname, int* sizePtr )
     world = allocateSquareMatrix( size + 2, DEAD );
 
     for (i = 1; i <= size; i++){
-        for (j = 1; j <= size; j++){
-            fscanf(inf, "%c", &world[i][j]);
+        readWorldRow(inf, world[i], size);
+    }
+    fclose(inf);
+
+    *sizePtr = size;    //return size
+    return world;
+    
+}
+
+FILE* openWorldFile( char* fname, int* sizePtr )
+{
+    FILE* inf;
+    char temp;
+
+    inf = fopen(fname,"r");
+    if (inf == NULL)
+        die(__LINE__);
+
+    if (fscanf(inf, "%d", sizePtr) != 1 || *sizePtr < 1)
+        die(__LINE__);
+    fscanf(inf, "%c", &temp);
+    return inf;
+}
+
+void readWorldRow( FILE* inf, char* row, int size )
+{
+    row[0] = DEAD;
+    row[size + 1] = DEAD;
+    if (fread(&row[1], 1, size, inf) != (size_t) size)
+        die(__LINE__);
+    fgetc(inf);     //end of line
+}
+
+void sendWorld( FILE* inf, int size, int pSize, int rows[], int tag )
+{
+    char** buf;
+    int i, start, stop, first, last, nBuf, g;
+
+    nBuf = 0;
+    start = 1;
+    for (i = 0; i < slaves; i++){
+        stop = min(start + rows[i] - 1 + pSize - 1, size + 1);
+        nBuf = max(nBuf, stop - start + 2);
+        start += rows[i];
+    }
+    buf = allocateMatrix(size + 2, nBuf, DEAD);
+
+    first = 0;      //global row in buf[0]
+    last = -1;      //last global row in buf
+    start = 1;
+    for (i = 0; i < slaves; i++){
+        //stops at size+1 as this is the last meaningful (halo) row
+        stop = min(start + rows[i] - 1 + pSize - 1, size + 1);
+        if (last >= start - 1)
+            memmove(buf[0], buf[start - 1 - first], 
+                (size_t) (last - start + 2) * (size + 2));
+        for (g = last + 1; g < start - 1; g++){
+            readWorldRow(inf, buf[0], size);
+        }
+        first = start - 1;
+        for (g = max(last + 1, first); g <= stop; g++){
+            if (g == 0 || g == size + 1)
+                memset(buf[g - first], DEAD, size + 2);
+            else
+                readWorldRow(inf, buf[g - first], size);
+        }
+        last = stop;
+        MPI_Send(buf[0], (stop - start + 2) * (size + 2), MPI_CHAR, i, 
+            tag, MPI_COMM_WORLD);
+        start += rows[i];
+    }
+    free(buf[0]);
+    free(buf);
+}
+
+int countNeighbours(char** world, int row, int col)
+//Assume 1 <= row, col <= size, no check 
+{
+    int i, j, count;
+
+    count = 0;
+    for(i = row-1; i <= row+1; i++){
+        for(j = col-1; j <= col+1; j++){
+            count += (world[i][j] == ALIVE );
+        }
+    }
+
+    //discount the center
+    count -= (world[row][col] == ALIVE);
+
+    return count;
+
+}
+
+void evolveWorld(char** curWorld, char** nextWorld, int row ,int col)
+{
+    evolveBlock(curWorld, nextWorld, 1, row, 1, col);
+}
+
+void evolveBlock(char** curWorld, char** nextWorld, int fromRow, int toRow,
+        int fromCol, int toCol)
+{
+    if (opt.kernel == KERNEL_LUT)
+        evolveBlockLUT(curWorld, nextWorld, fromRow, toRow, fromCol, toCol);
+    else
+        rule.kernel(curWorld, nextWorld, fromRow, toRow, fromCol, toCol);
+
+    if (opt.verify)
+        verifyBlock(curWorld, nextWorld, fromRow, toRow, fromCol, toCol);
+}
+
+#ifdef HAVE_NEON
+//0xFF in every lane whose count has its bit set in mask
+static inline uint8x16_t ruleLanes(uint8x16_t count, int mask)
+{
+    uint8x16_t lanes;
+    int n;
+
+    lanes = vdupq_n_u8(0);
+    for (n = 0; n <= 8; n++){
+        if ((mask >> n) & 1)
+            lanes = vorrq_u8(lanes, vceqq_u8(count, vdupq_n_u8(n)));
+    }
+    return lanes;
+}
+#endif
+
+//Sixteen cells per step with NEON, the eight neighbours summed lane by
+//lane from unaligned loads of bit 4 (see CELL_BIT).  The rest of a row,
+//and every cell without NEON, goes through countNeighbours.
+static inline void evolveCells(char** curWorld, char** nextWorld, 
+        int fromRow, int toRow, int fromCol, int toCol, 
+        int birth, int survive)
+{
+    int i, j, n;
+#ifdef HAVE_NEON
+    const uint8x16_t one = vdupq_n_u8(1), bit = vdupq_n_u8(0x10);
+    const uint8x16_t alive = vdupq_n_u8(ALIVE), dead = vdupq_n_u8(DEAD);
+    uint8x16_t count, self, next;
+    const uint8_t* row;
+    int dr, dc;
+#endif
+
+    for (i = fromRow; i <= toRow; i++){
+        j = fromCol;
+#ifdef HAVE_NEON
+        for (; j + 15 <= toCol; j += 16){
+            count = vdupq_n_u8(0);
+            for (dr = -1; dr <= 1; dr++){
+                row = (const uint8_t*) curWorld[i + dr] + j;
+                for (dc = -1; dc <= 1; dc++){
+                    if (dr != 0 || dc != 0)
+                        count = vaddq_u8(count, 
+                            vandq_u8(vshrq_n_u8(vld1q_u8(row + dc), 4), one));
+                }
+            }
+            self = vceqq_u8(vandq_u8(
+                vld1q_u8((const uint8_t*) curWorld[i] + j), bit), bit);
+            next = vbslq_u8(self, ruleLanes(count, survive), 
+                ruleLanes(count, birth));
+            vst1q_u8((uint8_t*) nextWorld[i] + j, vbslq_u8(next, alive, dead));
+        }
+#endif
+        for (; j <= toCol; j++){
+            n = countNeighbours(curWorld, i, j);
+            nextWorld[i][j] = (((curWorld[i][j] == ALIVE ? survive : birth)
+                >> n) & 1) ? ALIVE : DEAD;
+        }
+    }
+}
+
+//One kernel per common rule with its masks as constants
+#define RULE_KERNEL(name, birth, survive) \
+void evolve##name(char** curWorld, char** nextWorld, int fromRow, \
+        int toRow, int fromCol, int toCol) \
+{ \
+    evolveCells(curWorld, nextWorld, fromRow, toRow, fromCol, toCol, \
+        birth, survive); \
+}
+
+RULE_KERNEL(Life, RULE_B3, RULE_S23)
+RULE_KERNEL(HighLife, RULE_B36, RULE_S23)
+RULE_KERNEL(DayNight, RULE_B3678, RULE_S34678)
+RULE_KERNEL(Seeds, RULE_B2, 0)
+
+void evolveGeneric(char** curWorld, char** nextWorld, int fromRow, 
+        int toRow, int fromCol, int toCol)
+{
+    evolveCells(curWorld, nextWorld, fromRow, toRow, fromCol, toCol, 
+        rule.birth, rule.survive);
+}
+
+RULE ruleKernels[] = {
+    {RULE_B3, RULE_S23, evolveLife},
+    {RULE_B36, RULE_S23, evolveHighLife},
+    {RULE_B3678, RULE_S34678, evolveDayNight},
+    {RULE_B2, 0, evolveSeeds},
+};
+
+int parseRule(char* text, RULE* result)
+{
+    int* mask;
+    unsigned int k;
+
+    result->birth = result->survive = -1;
+    mask = NULL;
+    for (; *text != '\0'; text++){
+        if (*text == 'B' || *text == 'b'){
+            if (result->birth != -1) return 0;
+            mask = &result->birth;
+            *mask = 0;
+        } else if (*text == 'S' || *text == 's'){
+            if (result->survive != -1) return 0;
+            mask = &result->survive;
+            *mask = 0;
+        } else if (*text >= '0' && *text <= '8' && mask != NULL){
+            *mask |= 1 << (*text - '0');
+        } else if (*text != '/'){
+            return 0;
+        }
+    }
+    if (result->birth == -1 || result->survive == -1)
+        return 0;
+
+    result->kernel = evolveGeneric;
+    for (k = 0; k < sizeof(ruleKernels) / sizeof(ruleKernels[0]); k++){
+        if (ruleKernels[k].birth == result->birth 
+                && ruleKernels[k].survive == result->survive)
+            result->kernel = ruleKernels[k].kernel;
+    }
+    return 1;
+}
+
+void verifyBlock(char** curWorld, char** nextWorld, int fromRow, 
+        int toRow, int fromCol, int toCol)
+{
+    int i, j, n;
+    char expect;
+
+    for (i = fromRow; i <= toRow; i++){
+        for (j = fromCol; j <= toCol; j++){
+            n = countNeighbours(curWorld, i, j);
+            expect = (((curWorld[i][j] == ALIVE ? rule.survive : rule.birth)
+                >> n) & 1) ? ALIVE : DEAD;
+            if (nextWorld[i][j] != expect)
+                verifyFailed("evolve", i, j);
+        }
+    }
+}
+
+void verifyFailed(char* what, int row, int col)
+{
+    fprintf(stderr, "VERIFY %s mismatch on rank %d at local row %d,"
+        " column %d\n", what, myid, row, col);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+void buildLifeTable()
+{
+    int index, r, c, dr, dc, n, alive, next;
+
+    for (index = 0; index < (1 << 16); index++){
+        next = 0;
+        for (r = 1; r <= 2; r++){
+            for (c = 1; c <= 2; c++){
+                n = 0;
+                for (dr = -1; dr <= 1; dr++){
+                    for (dc = -1; dc <= 1; dc++){
+                        n += (index >> ((3 - (c + dc)) * 4 + r + dr)) & 1;
+                    }
+                }
+                alive = (index >> ((3 - c) * 4 + r)) & 1;
+                n -= alive;
+                if (((alive ? rule.survive : rule.birth) >> n) & 1)
+                    next |= 1 << ((r - 1) * 2 + c - 1);
+            }
+        }
+        lifeTable[index] = next;
+    }
+    lifeTableReady = 1;
+}
+
+void evolveBlockLUT(char** curWorld, char** nextWorld, int fromRow, 
+        int toRow, int fromCol, int toCol)
+{
+    static unsigned char* nibbles = NULL;
+    static int nNibbles = 0;
+    static const char pair[4][2] = {
+        {DEAD, DEAD}, {ALIVE, DEAD}, {DEAD, ALIVE}, {ALIVE, ALIVE}};
+    const uint64_t ones = 0x0101010101010101ull;
+    char *r0, *r1, *r2, *r3;
+    unsigned char *nib;
+    uint64_t a, b, c, d;
+    int i, j, k, count, index, out;
+
+    if (!lifeTableReady)
+        buildLifeTable();
+
+    //nibbles of columns fromCol-1 .. toCol+2, the last one is padding
+    count = toCol - fromCol + 4;
+    if (count > nNibbles){
+        free(nibbles);
+        nNibbles = count;
+        nibbles = (unsigned char*) malloc(nNibbles + 8);
+        if (nibbles == NULL)
+            die(__LINE__);
+    }
+
+    for (i = fromRow; i <= toRow; i += 2){
+        r0 = curWorld[i - 1] + fromCol - 1;
+        r1 = curWorld[i] + fromCol - 1;
+        r2 = curWorld[i + 1] + fromCol - 1;
+        //with an odd row left the fourth row reads as dead
+        r3 = (i < toRow) ? curWorld[i + 2] + fromCol - 1 : NULL;
+
+        k = 0;
+#ifdef HAVE_NEON
+        for (; k + 16 <= count - 1; k += 16){
+            vst1q_u8(nibbles + k, vorrq_u8(
+                vorrq_u8(vandq_u8(vshrq_n_u8(vld1q_u8(
+                        (const uint8_t*) r0 + k), 4), vdupq_n_u8(1)),
+                    vandq_u8(vshrq_n_u8(vld1q_u8(
+                        (const uint8_t*) r1 + k), 3), vdupq_n_u8(2))),
+                vorrq_u8(vandq_u8(vshrq_n_u8(vld1q_u8(
+                        (const uint8_t*) r2 + k), 2), vdupq_n_u8(4)),
+                    r3 == NULL ? vdupq_n_u8(0) : vandq_u8(vshrq_n_u8(
+                        vld1q_u8((const uint8_t*) r3 + k), 1), 
+                        vdupq_n_u8(8)))));
+        }
+#endif
+        //Eight columns per step: bit 4 of every byte moved to bit 0..3
+        for (; k + 8 <= count - 1; k += 8){
+            memcpy(&a, r0 + k, 8);
+            memcpy(&b, r1 + k, 8);
+            memcpy(&c, r2 + k, 8);
+            d = 0;
+            if (r3 != NULL)
+                memcpy(&d, r3 + k, 8);
+            a = ((a >> 4) & ones) | ((b >> 3) & (ones << 1))
+                | ((c >> 2) & (ones << 2)) | ((d >> 1) & (ones << 3));
+            memcpy(nibbles + k, &a, 8);
+        }
+        for (; k < count - 1; k++){
+            nibbles[k] = CELL_BIT(r0[k]) | CELL_BIT(r1[k]) << 1 
+                | CELL_BIT(r2[k]) << 2 
+                | (r3 != NULL ? CELL_BIT(r3[k]) << 3 : 0);
+        }
+        nibbles[count - 1] = 0;
+
+        for (j = fromCol, nib = nibbles; j <= toCol; j += 2, nib += 2){
+            index = nib[0] << 12 | nib[1] << 8 | nib[2] << 4 | nib[3];
+            out = lifeTable[index];
+            if (j < toCol){
+                memcpy(nextWorld[i] + j, pair[out & 3], 2);
+                if (r3 != NULL)
+                    memcpy(nextWorld[i + 1] + j, pair[out >> 2], 2);
+            } else {
+                nextWorld[i][j] = pair[out & 3][0];
+                if (r3 != NULL)
+                    nextWorld[i + 1][j] = pair[out >> 2][0];
+            }
+        }
+    }
+}
+
+/***********************************************************
+   Row band related functions
+***********************************************************/
+
+void partitionRows(int size, int parts, double weights[], int rows[])
+{
+    double total, quota[parts];
+    int i, best, given;
+
+    total = 0;
+    for (i = 0; i < parts; i++){
+        total += (weights == NULL) ? 1.0 : weights[i];
+    }
+
+    //Largest remainder: floor of every quota, the leftover rows go to 
+    //the biggest fractions (lowest rank first on ties), so equal 
+    //weights give the classic size / parts split
+    given = 0;
+    for (i = 0; i < parts; i++){
+        quota[i] = size * ((weights == NULL) ? 1.0 : weights[i]) / total;
+        rows[i] = (int) quota[i];
+        quota[i] -= rows[i];
+        given += rows[i];
+    }
+    for (; given < size; given++){
+        best = 0;
+        for (i = 1; i < parts; i++){
+            if (quota[i] > quota[best]) best = i;
+        }
+        rows[best]++;
+        quota[best] = -1;
+    }
+}
+
+void allocateBand(BAND* band, int start, int rows, int size, int pSize)
+{
+    int stopRow;
+
+    //stops at size+1 as this is the last meaningful (halo) row
+    stopRow = start + rows - 1 + pSize - 1;
+    if (!opt.torus)
+        stopRow = min(stopRow, size + 1);
+
+    band->start = start;
+    band->rows = rows;
+    band->nRows = stopRow - start + 2;
+    band->size = size;
+    band->width = opt.torus ? size + max(pSize, 2) : size + 2;
+    band->cur = allocateBandMatrix(band->width, band->nRows);
+    band->next = allocateBandMatrix(band->width, band->nRows);
+    band->lo = band->hi = band->nextLo = band->nextHi = NULL;
+}
+
+void freeBand(BAND* band)
+{
+    freeBandMatrix(band->cur, band->width, band->nRows);
+    freeBandMatrix(band->next, band->width, band->nRows);
+    free(band->lo);
+    free(band->hi);
+    free(band->nextLo);
+    free(band->nextHi);
+    band->lo = band->hi = band->nextLo = band->nextHi = NULL;
+}
+
+//Huge page mappings are unmapped in whole huge pages
+static size_t bandBytes(int width, int rows)
+{
+    size_t bytes;
+
+    bytes = (size_t) width * rows;
+    if (bytes >= BAND_HUGE_BYTES)
+        bytes = (bytes + BAND_HUGE_BYTES - 1) / BAND_HUGE_BYTES 
+            * BAND_HUGE_BYTES;
+    return bytes;
+}
+
+char** allocateBandMatrix(int width, int rows)
+{
+    char** matrix;
+    char* cells;
+    size_t bytes;
+    int i;
+
+    bytes = bandBytes(width, rows);
+    cells = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (bytes >= BAND_HUGE_BYTES)
+        cells = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (cells == MAP_FAILED){
+        cells = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cells == MAP_FAILED)
+            die(__LINE__);
+#ifdef MADV_HUGEPAGE
+        if (bytes >= BAND_HUGE_BYTES)
+            madvise(cells, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    memset(cells, DEAD, (size_t) width * rows);
+
+    matrix = (char**) malloc(sizeof(char*) * rows);
+    if (matrix == NULL) 
+        die(__LINE__);
+    for (i = 0; i < rows; i++){
+        matrix[i] = &cells[(size_t) i * width];
+    }
+    return matrix;
+}
+
+void freeBandMatrix(char** matrix, int width, int rows)
+{
+    if (matrix == NULL) return;
+
+    munmap(matrix[0], bandBytes(width, rows));
+    free(matrix);
+}
+
+int fusedStripRows(int width, int pSize)
+{
+    long bytes;
+
+    bytes = FUSED_STRIP_BYTES;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    if (sysconf(_SC_LEVEL2_CACHE_SIZE) > 0)
+        bytes = sysconf(_SC_LEVEL2_CACHE_SIZE) / 2;
+#endif
+
+    //a strip of h rows reads h+pSize cur rows and writes h next rows
+    return max((int) (bytes / (width + 2) - pSize) / 2, 1);
+}
+
+void fusedPass(BAND* band, int iteration, char** patterns[4], int pSize,
+        MATCHSINK* sink, int search, int stripRows, int tileCols)
+{
+    int first, last, lastSearch, lastEvolve, size;
+    int left, right, lastCol;
+    long long t;
+
+    size = band->size;
+    //same ranges as searchPatterns and evolveWorld over the band
+    lastSearch = band->nRows - pSize;
+    lastEvolve = band->nRows - 2;
+    lastCol = opt.torus ? size : size - pSize + 1;
+    if (tileCols <= 0)
+        tileCols = size;
+
+    for (first = 1; first <= max(lastSearch, lastEvolve); first += stripRows){
+        last = first + stripRows - 1;
+        for (left = 1; left <= size; left += tileCols){
+            right = min(left + tileCols - 1, size);
+            if (search && first <= lastSearch && left <= lastCol){
+                t = monotonicTime();
+                searchBlockRotations(band->cur, first, min(last, lastSearch),
+                    left, min(right, lastCol), size, iteration, patterns, 
+                    pSize, sink, band->start-1);
+                phaseEnd(PHASE_SEARCH, t);
+            }
+            if (first <= lastEvolve){
+                t = monotonicTime();
+                evolveBlock(band->cur, band->next, first, 
+                    min(last, lastEvolve), left, right);
+                phaseEnd(PHASE_EVOLVE, t);
+            }
+        }
+    }
+}
+
+int autotuneTile(BAND* band, int pSize)
+{
+    BAND view;
+    int cols, best, size, rep, stripRows;
+    long long t, elapsed, bestTime, evolveTime;
+
+    //Time only the first rows, the pass writes band->next which the 
+    //first real generation overwrites anyway
+    view = *band;
+    view.nRows = min(band->nRows, TILE_TUNE_ROWS + 2);
+    size = band->size;
+    evolveTime = phaseTime[PHASE_EVOLVE];
+
+    best = 0;
+    bestTime = LLONG_MAX;
+    for (cols = TILE_MIN_COLS; ; cols *= 2){
+        if (cols >= size)
+            cols = 0;
+        stripRows = fusedStripRows(cols > 0 ? cols : size, pSize);
+        elapsed = LLONG_MAX;
+        for (rep = 0; rep < TILE_TUNE_REPS; rep++){
+            t = monotonicTime();
+            fusedPass(&view, 0, NULL, pSize, NULL, 0, stripRows, cols);
+            t = monotonicTime() - t;
+            if (t < elapsed)
+                elapsed = t;
+        }
+        if (elapsed < bestTime){
+            bestTime = elapsed;
+            best = cols;
+        }
+        if (cols == 0)
+            break;
+    }
+
+    //tuning time is booked as start up, not as evolve
+    phaseTime[PHASE_EVOLVE] = evolveTime;
+    return best;
+}
+
+//Fill buffer with a halo row and return its bytes, none for a dead row
+//under --bbox
+static int haloLoad(BAND* band, int row, char* buffer)
+{
+    if (band->lo != NULL && band->lo[row] > band->hi[row])
+        return 0;
+    if (opt.pack)
+        return packHalo(&band->cur[row], 1, band->size, 
+            (unsigned char*) buffer);
+    memcpy(buffer, band->cur[row] + 1, band->size);
+    return band->size;
+}
+
+static void clearColumns(char* row, int from, int to)
+{
+    if (from <= to)
+        memset(row + from, DEAD, to - from + 1);
+}
+
+//Store a received halo row, an empty message being a dead row
+static void haloStore(BAND* band, int row, char* buffer, MPI_Status* status)
+{
+    int count;
+
+    MPI_Get_count(status, MPI_CHAR, &count);
+    if (count == 0){
+        clearColumns(band->cur[row], band->lo[row], band->hi[row]);
+        band->lo[row] = band->size + 1;
+        band->hi[row] = 0;
+        return;
+    }
+    if (opt.pack)
+        unpackHalo((unsigned char*) buffer, count, &band->cur[row], 1, 
+            band->size);
+    else
+        memcpy(band->cur[row] + 1, buffer, band->size);
+    if (band->lo != NULL)
+        rowSpan(band->cur[row], 1, band->size, &band->lo[row], 
+            &band->hi[row]);
+}
+
+void exchangeHalo(BAND* band, int pSize, int iteration)
+{
+    int size = band->size, count;
+    char buffer[size + 2];
+    long long t;
+    MPI_Status status;
+
+    if (opt.halo == HALO_PERSISTENT){
+        exchangeHaloPersistent(band, pSize);
+        return;
+    }
+    if (opt.halo == HALO_RMA || opt.halo == HALO_RMA_FENCE){
+        exchangeHaloRMA(band, pSize);
+        return;
+    }
+    if (opt.torus){
+        exchangeHaloRing(band, pSize);
+        return;
+    }
+
+    //--bbox sends dead rows as empty messages
+    t = monotonicTime();
+    if (myid != 0){
+        for (int j = 0; j < pSize-1; j++){
+            count = haloLoad(band, j+1, buffer);
+            MPI_Send(buffer, count, MPI_CHAR, myid - 1, iteration * size + myid +j, MPI_COMM_WORLD);
+        }
+
+    }
+    if (myid != slaves-1){
+        count = haloLoad(band, band->nRows - pSize, buffer);
+        MPI_Send(buffer, count, MPI_CHAR, myid + 1, iteration * size +myid, MPI_COMM_WORLD);
+    }
+    phaseEnd(PHASE_HALO_SEND, t);
+
+    t = monotonicTime();
+    if (myid != 0){
+        MPI_Recv(buffer, size + 2, MPI_CHAR, myid - 1, iteration * size + (myid-1), MPI_COMM_WORLD,&status);
+        haloStore(band, 0, buffer, &status);
+    }
+
+    if (myid != slaves-1){
+        for (int j = 0; j < pSize-1; j++){
+            MPI_Recv(buffer, size + 2, MPI_CHAR, myid + 1, iteration * size + (myid+1) + j, MPI_COMM_WORLD, &status);
+            haloStore(band, j + band->nRows - pSize +1, buffer, &status);
+        }            
+    }
+    phaseEnd(PHASE_HALO_WAIT, t);
+}
+
+void exchangeHaloRing(BAND* band, int pSize)
+{
+    int up, down;
+    MPI_Request req[4];
+    long long t;
+
+    if (opt.pack){
+        exchangeHaloRingPacked(band, pSize);
+        return;
+    }
+
+    //Bands are contiguous, so each side is a single message of whole
+    //rows.  Their column halos are stale and wrapped below.
+    t = monotonicTime();
+    MPI_Cart_shift(ringComm, 0, 1, &up, &down);
+    MPI_Irecv(band->cur[0], band->width, MPI_CHAR, up, HALO_DOWN_TAG, 
+        ringComm, &req[0]);
+    MPI_Irecv(band->cur[band->rows + 1], (pSize - 1) * band->width, 
+        MPI_CHAR, down, HALO_UP_TAG, ringComm, &req[1]);
+    MPI_Isend(band->cur[1], (pSize - 1) * band->width, MPI_CHAR, up, 
+        HALO_UP_TAG, ringComm, &req[2]);
+    MPI_Isend(band->cur[band->rows], band->width, MPI_CHAR, down, 
+        HALO_DOWN_TAG, ringComm, &req[3]);
+    phaseEnd(PHASE_HALO_SEND, t);
+
+    t = monotonicTime();
+    MPI_Waitall(4, req, MPI_STATUSES_IGNORE);
+    wrapColumns(band);
+    phaseEnd(PHASE_HALO_WAIT, t);
+}
+
+void exchangeHaloRingPacked(BAND* band, int pSize)
+{
+    HALOPLAN* plan = &haloPlan;
+    int count, size = band->size;
+    MPI_Request req[4];
+    MPI_Status status[4];
+    long long t;
+
+    //The messages vary in size with --pack=rle, only the buffers are
+    //kept in the plan
+    t = monotonicTime();
+    if (!plan->ready)
+        haloPlanInit(plan, size, pSize);
+    MPI_Irecv(plan->fromUp, plan->nDown, MPI_CHAR, plan->up, HALO_DOWN_TAG,
+        ringComm, &req[0]);
+    MPI_Irecv(plan->fromDown, plan->nUp, MPI_CHAR, plan->down, HALO_UP_TAG,
+        ringComm, &req[1]);
+    count = packHalo(&band->cur[1], pSize - 1, size, 
+        (unsigned char*) plan->toUp);
+    MPI_Isend(plan->toUp, count, MPI_CHAR, plan->up, HALO_UP_TAG, ringComm,
+        &req[2]);
+    count = packHalo(&band->cur[band->rows], 1, size, 
+        (unsigned char*) plan->toDown);
+    MPI_Isend(plan->toDown, count, MPI_CHAR, plan->down, HALO_DOWN_TAG, 
+        ringComm, &req[3]);
+    phaseEnd(PHASE_HALO_SEND, t);
+
+    t = monotonicTime();
+    MPI_Waitall(4, req, status);
+    MPI_Get_count(&status[0], MPI_CHAR, &count);
+    unpackHalo((unsigned char*) plan->fromUp, count, &band->cur[0], 1, size);
+    MPI_Get_count(&status[1], MPI_CHAR, &count);
+    unpackHalo((unsigned char*) plan->fromDown, count, 
+        &band->cur[band->rows + 1], pSize - 1, size);
+    wrapColumns(band);
+    phaseEnd(PHASE_HALO_WAIT, t);
+}
+
+void exchangeHaloPersistent(BAND* band, int pSize)
+{
+    HALOPLAN* plan = &haloPlan;
+    long long t;
+
+    t = monotonicTime();
+    if (!plan->ready)
+        haloPlanInit(plan, band->size, pSize);
+    haloRowsOut(band, 1, pSize - 1, plan->toUp);
+    haloRowsOut(band, band->nRows - pSize, 1, plan->toDown);
+    MPI_Startall(4, plan->req);
+    phaseEnd(PHASE_HALO_SEND, t);
+
+    t = monotonicTime();
+    MPI_Waitall(4, plan->req, MPI_STATUSES_IGNORE);
+    if (plan->up != MPI_PROC_NULL)
+        haloRowsIn(band, 0, 1, plan->fromUp);
+    if (plan->down != MPI_PROC_NULL)
+        haloRowsIn(band, band->nRows - pSize + 1, pSize - 1, 
+            plan->fromDown);
+    if (opt.torus)
+        wrapColumns(band);
+    phaseEnd(PHASE_HALO_WAIT, t);
+}
+
+void exchangeHaloRMA(BAND* band, int pSize)
+{
+    HALOPLAN* plan = &haloPlan;
+    long long t;
+
+    t = monotonicTime();
+    if (!plan->ready)
+        haloPlanInit(plan, band->size, pSize);
+    haloRowsOut(band, 1, pSize - 1, plan->toUp);
+    haloRowsOut(band, band->nRows - pSize, 1, plan->toDown);
+    if (plan->win == MPI_WIN_NULL){
+        //a single slave is its own neighbour on a torus
+        if (opt.torus){
+            memcpy(plan->fromDown, plan->toUp, plan->nUp);
+            memcpy(plan->fromUp, plan->toDown, plan->nDown);
+        }
+    } else {
+        if (opt.halo == HALO_RMA){
+            MPI_Win_post(plan->neighbours, 0, plan->win);
+            MPI_Win_start(plan->neighbours, 0, plan->win);
+        } else
+            MPI_Win_fence(MPI_MODE_NOPRECEDE, plan->win);
+        //rows to up land in its fromDown, rows to down in its fromUp
+        if (plan->up != MPI_PROC_NULL)
+            MPI_Put(plan->toUp, plan->nUp, MPI_CHAR, plan->up, plan->nDown,
+                plan->nUp, MPI_CHAR, plan->win);
+        if (plan->down != MPI_PROC_NULL)
+            MPI_Put(plan->toDown, plan->nDown, MPI_CHAR, plan->down, 0,
+                plan->nDown, MPI_CHAR, plan->win);
+    }
+    phaseEnd(PHASE_HALO_SEND, t);
+
+    t = monotonicTime();
+    if (plan->win != MPI_WIN_NULL && opt.halo == HALO_RMA){
+        MPI_Win_complete(plan->win);
+        MPI_Win_wait(plan->win);
+    } else if (plan->win != MPI_WIN_NULL)
+        MPI_Win_fence(MPI_MODE_NOSUCCEED, plan->win);
+    if (plan->up != MPI_PROC_NULL)
+        haloRowsIn(band, 0, 1, plan->fromUp);
+    if (plan->down != MPI_PROC_NULL)
+        haloRowsIn(band, band->nRows - pSize + 1, pSize - 1, 
+            plan->fromDown);
+    if (opt.torus)
+        wrapColumns(band);
+    phaseEnd(PHASE_HALO_WAIT, t);
+}
+
+void haloPlanInit(HALOPLAN* plan, int size, int pSize)
+{
+    MPI_Comm comm;
+    MPI_Group all;
+    int ranks[2], nRanks = 0;
+
+    if (opt.torus){
+        comm = ringComm;
+        MPI_Cart_shift(ringComm, 0, 1, &plan->up, &plan->down);
+    } else {
+        comm = workerComm;
+        plan->up = myid == 0 ? MPI_PROC_NULL : myid - 1;
+        plan->down = myid == slaves - 1 ? MPI_PROC_NULL : myid + 1;
+    }
+    if (opt.pack){
+        plan->nUp = PACK_MAX_BYTES(pSize - 1, size);
+        plan->nDown = PACK_MAX_BYTES(1, size);
+    } else {
+        plan->nUp = (pSize - 1) * size;
+        plan->nDown = size;
+    }
+    if (MPI_Alloc_mem(2 * (plan->nUp + plan->nDown), MPI_INFO_NULL, 
+            &plan->toUp) != MPI_SUCCESS)
+        die(__LINE__);
+    plan->toDown = plan->toUp + plan->nUp;
+    plan->fromUp = plan->toDown + plan->nDown;
+    plan->fromDown = plan->fromUp + plan->nDown;
+    plan->ready = 1;
+
+    //No window for a single slave, it would only talk to itself
+    plan->win = MPI_WIN_NULL;
+    if ((opt.halo == HALO_RMA || opt.halo == HALO_RMA_FENCE) && slaves > 1){
+        MPI_Win_create(plan->fromUp, plan->nDown + plan->nUp, 1, 
+            MPI_INFO_NULL, comm, &plan->win);
+        if (plan->up != MPI_PROC_NULL)
+            ranks[nRanks++] = plan->up;
+        if (plan->down != MPI_PROC_NULL && plan->down != plan->up)
+            ranks[nRanks++] = plan->down;
+        MPI_Comm_group(comm, &all);
+        MPI_Group_incl(all, nRanks, ranks, &plan->neighbours);
+        MPI_Group_free(&all);
+    }
+    if (opt.halo != HALO_PERSISTENT)
+        return;
+    MPI_Recv_init(plan->fromUp, plan->nDown, MPI_CHAR, plan->up, 
+        HALO_DOWN_TAG, comm, &plan->req[0]);
+    MPI_Recv_init(plan->fromDown, plan->nUp, MPI_CHAR, plan->down, 
+        HALO_UP_TAG, comm, &plan->req[1]);
+    MPI_Send_init(plan->toUp, plan->nUp, MPI_CHAR, plan->up, HALO_UP_TAG,
+        comm, &plan->req[2]);
+    MPI_Send_init(plan->toDown, plan->nDown, MPI_CHAR, plan->down, 
+        HALO_DOWN_TAG, comm, &plan->req[3]);
+}
+
+void haloPlanFree(HALOPLAN* plan)
+{
+    int i;
+
+    if (!plan->ready)
+        return;
+    if (opt.halo == HALO_PERSISTENT){
+        for (i = 0; i < 4; i++){
+            MPI_Request_free(&plan->req[i]);
+        }
+    } else if (plan->win != MPI_WIN_NULL){
+        MPI_Win_free(&plan->win);
+        MPI_Group_free(&plan->neighbours);
+    }
+    MPI_Free_mem(plan->toUp);
+    plan->ready = 0;
+}
+
+void haloRowsOut(BAND* band, int first, int n, char* buffer)
+{
+    int i;
+
+    if (opt.pack){
+        packHalo(&band->cur[first], n, band->size, (unsigned char*) buffer);
+        return;
+    }
+    for (i = 0; i < n; i++){
+        memcpy(buffer + i * band->size, band->cur[first + i] + 1, 
+            band->size);
+    }
+}
+
+void haloRowsIn(BAND* band, int first, int n, char* buffer)
+{
+    int i;
+
+    if (opt.pack)
+        unpackHalo((unsigned char*) buffer, PACK_MAX_BYTES(n, band->size),
+            &band->cur[first], n, band->size);
+    else {
+        for (i = 0; i < n; i++){
+            memcpy(band->cur[first + i] + 1, buffer + i * band->size, 
+                band->size);
+        }
+    }
+    if (band->lo != NULL){
+        for (i = first; i < first + n; i++){
+            rowSpan(band->cur[i], 1, band->size, &band->lo[i], 
+                &band->hi[i]);
+        }
+    }
+}
+
+void wrapColumns(BAND* band)
+{
+    int i, size = band->size;
+    char* row;
+
+    for (i = 0; i < band->nRows; i++){
+        row = band->cur[i];
+        row[0] = row[size];
+        memcpy(row + size + 1, row + 1, band->width - size - 1);
+    }
+}
+
+//Zero byte runs and literal bytes of in, as pairs of counts each 
+//followed by its literals.  Returns limit when that is not shorter.
+static int encodeRuns(const unsigned char* in, int n, unsigned char* out,
+        int limit)
+{
+    int i = 0, len = 0, zeros, literals;
+
+    while (i < n){
+        for (zeros = 0; i < n && in[i] == 0 && zeros < 255; zeros++)
+            i++;
+        for (literals = 0; i + literals < n && in[i + literals] != 0 
+                && literals < 255; literals++)
+            ;
+        if (len + 2 + literals >= limit)
+            return limit;
+        out[len++] = zeros;
+        out[len++] = literals;
+        memcpy(out + len, in + i, literals);
+        len += literals;
+        i += literals;
+    }
+    return len;
+}
+
+static void decodeRuns(const unsigned char* in, int len, unsigned char* out,
+        int n)
+{
+    int i = 0, o = 0, zeros, literals;
+
+    while (i + 2 <= len){
+        zeros = in[i++];
+        literals = in[i++];
+        if (o + zeros + literals > n || i + literals > len)
+            die(__LINE__);
+        memset(out + o, 0, zeros);
+        o += zeros;
+        memcpy(out + o, in + i, literals);
+        o += literals;
+        i += literals;
+    }
+    if (o != n)
+        die(__LINE__);
+}
+
+int packHalo(char** rows, int n, int size, unsigned char* out)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    int rowBytes = (size + 7) / 8, nBytes = n * rowBytes, r, k, len;
+    unsigned char *bits = out + 1, *dst;
+    char* row;
+    uint64_t w;
+
+    //'X' has bit 4 set and 'O' does not.  The multiply gathers bit 0 of
+    //the 8 bytes of a word into its top byte.
+    for (r = 0; r < n; r++){
+        row = rows[r] + 1;
+        dst = bits + r * rowBytes;
+        for (k = 0; k + 8 <= size; k += 8){
+            memcpy(&w, row + k, 8);
+            dst[k / 8] = (((w >> 4) & ones) * 0x0102040810204080ull) >> 56;
+        }
+        if (k < size){
+            dst[k / 8] = 0;
+            for (; k < size; k++){
+                dst[k / 8] |= (row[k] == ALIVE) << (k % 8);
+            }
+        }
+    }
+    out[0] = PACK_BITS;
+    if (opt.pack == PACK_RLE && nBytes > 2){
+        unsigned char runs[nBytes];
+        len = encodeRuns(bits, nBytes, runs, nBytes);
+        if (len < nBytes){
+            out[0] = PACK_RLE;
+            memcpy(bits, runs, len);
+            return 1 + len;
+        }
+    }
+    return 1 + nBytes;
+}
+
+void unpackHalo(unsigned char* in, int bytes, char** rows, int n, int size)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t high = 0x8080808080808080ull;
+    int rowBytes = (size + 7) / 8, nBytes = n * rowBytes, r, k;
+    unsigned char runs[in[0] == PACK_RLE ? nBytes : 1];
+    unsigned char *bits = in + 1, *src;
+    char* row;
+    uint64_t w;
+
+    if (in[0] == PACK_RLE){
+        decodeRuns(in + 1, bytes - 1, runs, nBytes);
+        bits = runs;
+    } else if (bytes != 1 + nBytes)
+        die(__LINE__);
+
+    //Spread byte b to all 8 bytes, keep bit i in byte i, then turn the
+    //non zero bytes into 1 by carrying into their top bit
+    for (r = 0; r < n; r++){
+        row = rows[r] + 1;
+        src = bits + r * rowBytes;
+        for (k = 0; k + 8 <= size; k += 8){
+            w = (src[k / 8] * ones) & 0x8040201008040201ull;
+            w = (((w + ~high) & high) >> 7) * (ALIVE - DEAD) + DEAD * ones;
+            memcpy(row + k, &w, 8);
+        }
+        for (; k < size; k++){
+            row[k] = (src[k / 8] >> (k % 8)) & 1 ? ALIVE : DEAD;
+        }
+    }
+}
+
+void initSpans(BAND* band)
+{
+    int** spans[4] = {&band->lo, &band->hi, &band->nextLo, &band->nextHi};
+    int k, r;
+
+    for (k = 0; k < 4; k++){
+        free(*spans[k]);
+        *spans[k] = (int*) malloc(band->nRows * sizeof(int));
+        if (*spans[k] == NULL)
+            die(__LINE__);
+    }
+    for (r = 0; r < band->nRows; r++){
+        rowSpan(band->cur[r], 1, band->size, &band->lo[r], &band->hi[r]);
+        band->nextLo[r] = band->size + 1;
+        band->nextHi[r] = 0;
+    }
+}
+
+void rowSpan(char* row, int from, int to, int* lo, int* hi)
+{
+    while (from <= to && row[from] != ALIVE)
+        from++;
+    while (to >= from && row[to] != ALIVE)
+        to--;
+    *lo = from;
+    *hi = to;
+}
+
+void evolveSpans(BAND* band)
+{
+    int i, k, from, to, size = band->size;
+    char** next = band->next;
+
+    for (i = 1; i <= band->rows; i++){
+        from = size + 1;
+        to = 0;
+        for (k = i - 1; k <= i + 1; k++){
+            if (band->lo[k] <= band->hi[k]){
+                from = min(from, band->lo[k] - 1);
+                to = max(to, band->hi[k] + 1);
+            }
+        }
+        from = max(from, 1);
+        to = min(to, size);
+
+        //next still holds generation t-1, whose live cells outside the
+        //evolved columns die
+        if (from > to){
+            clearColumns(next[i], band->nextLo[i], band->nextHi[i]);
+            band->nextLo[i] = size + 1;
+            band->nextHi[i] = 0;
+            continue;
+        }
+        clearColumns(next[i], band->nextLo[i], min(band->nextHi[i], from-1));
+        clearColumns(next[i], max(band->nextLo[i], to+1), band->nextHi[i]);
+        evolveBlock(band->cur, next, i, i, from, to);
+        rowSpan(next[i], from, to, &band->nextLo[i], &band->nextHi[i]);
+    }
+}
+
+void searchSpans(BAND* band, int iteration, char** patterns[4], int pSize,
+        MATCHSINK* sink)
+{
+    int wRow, k, from, to, first, runFrom = 0, runTo = 0, live = 0;
+    int lastRow = band->nRows - pSize, size = band->size;
+
+    for (k = 0; k < pSize * pSize; k++){
+        live |= patterns[N][k / pSize][k % pSize] == ALIVE;
+    }
+    if (!live || opt.maxMismatch > 0){
+        searchPatterns(band->cur, band->nRows-1, size, iteration, patterns,
+            pSize, sink, band->start-1);
+        return;
+    }
+
+    //A live pattern cell needs a live world cell, so windows start at
+    //most pSize-1 columns left of the span of their rows.  Runs of rows
+    //with windows are searched as one block over the union of their 
+    //columns, so --prefilter and the approximate search set up once per
+    //run.  The rotations interleave by run, sink->rotList[] keeps the 
+    //output order.
+    first = 0;
+    for (wRow = 1; wRow <= lastRow + 1; wRow++){
+        from = size + 1;
+        to = 0;
+        for (k = wRow; wRow <= lastRow && k < wRow + pSize; k++){
+            if (band->lo[k] <= band->hi[k]){
+                from = min(from, band->lo[k]);
+                to = max(to, band->hi[k]);
+            }
+        }
+        from = max(from - pSize + 1, 1);
+        to = min(to, size - pSize + 1);
+        if (from <= to && first > 0){
+            runFrom = min(runFrom, from);
+            runTo = max(runTo, to);
+            continue;
+        }
+        if (first > 0)
+            searchBlockRotations(band->cur, first, wRow - 1, runFrom, runTo,
+                size, iteration, patterns, pSize, sink, band->start-1);
+        first = 0;
+        if (from <= to){
+            first = wRow;
+            runFrom = from;
+            runTo = to;
+        }
+    }
+}
+
+void swapSpans(BAND* band)
+{
+    int* temp;
+
+    temp = band->lo;
+    band->lo = band->nextLo;
+    band->nextLo = temp;
+    temp = band->hi;
+    band->hi = band->nextHi;
+    band->nextHi = temp;
+}
+
+void planPartition(int size, int pSize, int rows[])
+{
+    double weight = 0, weights[slaves + 1];
+    int r, biggest, minRows;
+    long long t;
+
+    if (opt.weightFile == NULL && !opt.calibrate){
+        partitionRows(size, slaves, NULL, rows);
+        return;
+    }
+
+    if (myid != MASTER_ID){
+        t = monotonicTime();
+        if (opt.weightFile != NULL)
+            weight = hostWeight(opt.weightFile);
+        else 
+            weight = calibrateWeight(size);
+        phaseEnd(PHASE_LOAD, t);
+    }
+    MPI_Gather(&weight, 1, MPI_DOUBLE, weights, 1, MPI_DOUBLE, MASTER_ID,
+        MPI_COMM_WORLD);
+
+    if (myid == MASTER_ID){
+        partitionRows(size, slaves, weights, rows);
+
+        //Same floor as rebalancing: a band sends pSize-1 rows upwards
+        minRows = (pSize > 2) ? pSize - 1 : 1;
+        for (r = 0; r < slaves; r++){
+            while (rows[r] < minRows){
+                biggest = 0;
+                for (int q = 1; q < slaves; q++){
+                    if (rows[q] > rows[biggest]) biggest = q;
+                }
+                if (rows[biggest] <= minRows)
+                    die(__LINE__);
+                rows[biggest]--;
+                rows[r]++;
+            }
+        }
+
+        if (opt.showPhases){
+            fprintf(stderr, "PARTITION");
+            for (r = 0; r < slaves; r++){
+                fprintf(stderr, " %d:%.3g:%d", r, weights[r], rows[r]);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+    MPI_Bcast(rows, slaves, MPI_INT, MASTER_ID, MPI_COMM_WORLD);
+}
+
+//Weight file lines are "<host> <weight>", '#' starts a comment.  The
+//host matches the full processor name or its part before the first
+//dot, hosts not listed get weight 1.
+double hostWeight(char* fname)
+{
+    FILE* inf;
+    char host[MPI_MAX_PROCESSOR_NAME], line[256], name[256];
+    int len;
+    size_t shortLen;
+    double weight, found = 1.0;
+
+    MPI_Get_processor_name(host, &len);
+    shortLen = strcspn(host, ".");
+
+    inf = fopen(fname, "r");
+    if (inf == NULL)
+        die(__LINE__);
+
+    while (fgets(line, sizeof(line), inf) != NULL){
+        if (line[0] == '#' || sscanf(line, "%255s %lf", name, &weight) != 2)
+            continue;
+        if (strcmp(name, host) == 0 || (strlen(name) == shortLen 
+                && strncmp(name, host, shortLen) == 0)){
+            found = weight;
+            break;
+        }
+    }
+    fclose(inf);
+
+    if (found <= 0)
+        die(__LINE__);
+    return found;
+}
+
+//Cell generations per second of evolveWorld on a random band of
+//CALIBRATE_ROWS rows, as wide as the real band up to CALIBRATE_WIDTH
+double calibrateWeight(int size)
+{
+    char **curW, **nextW, **temp;
+    int width, i, j, reps;
+    long long before, elapsed;
+
+    width = min(size, CALIBRATE_WIDTH);
+    curW = allocateMatrix(width + 2, CALIBRATE_ROWS + 2, DEAD);
+    nextW = allocateMatrix(width + 2, CALIBRATE_ROWS + 2, DEAD);
+
+    srand48(3210);
+    for (i = 1; i <= CALIBRATE_ROWS; i++){
+        for (j = 1; j <= width; j++){
+            curW[i][j] = (drand48() < 0.3) ? ALIVE : DEAD;
+        }
+    }
+
+    //Warm up once, then run for at least CALIBRATE_NS
+    evolveWorld(curW, nextW, CALIBRATE_ROWS, width);
+    reps = 0;
+    before = monotonicTime();
+    do {
+        evolveWorld(curW, nextW, CALIBRATE_ROWS, width);
+        temp = curW;
+        curW = nextW;
+        nextW = temp;
+        reps++;
+        elapsed = monotonicTime() - before;
+    } while (elapsed < CALIBRATE_NS);
+
+    free(curW[0]);
+    free(curW);
+    free(nextW[0]);
+    free(nextW);
+
+    return (double) reps * CALIBRATE_ROWS * width / (elapsed / 1e9);
+}
+
+//Runs on slave 0 only: turns the gathered busy time of every band into
+//new band boundaries.  bounds[r] is the first row of band r and
+//bounds[slaves] is size+1.  Returns 0 when the bands are left alone.
+int planRebalance(int size, int pSize, int rows[], long long busy[], 
+        int bounds[])
+{
+    double speed[slaves];
+    int newRows[slaves], old[slaves + 1];
+    int r, minRows, lo, hi;
+    long long fastest, slowest;
+
+    fastest = slowest = busy[0];
+    for (r = 0; r < slaves; r++){
+        if (busy[r] < fastest) fastest = busy[r];
+        if (busy[r] > slowest) slowest = busy[r];
+        speed[r] = (double) rows[r] / (busy[r] > 0 ? busy[r] : 1);
+    }
+    if (slowest <= fastest * (1 + REBALANCE_TOLERANCE))
+        return 0;
+
+    partitionRows(size, slaves, speed, newRows);
+
+    //Every band keeps pSize-1 rows for the halo it sends upwards, and
+    //a boundary moves by at most half of the donating band's spare rows.
+    //The rows a band gains are then always held by the neighbour.
+    minRows = (pSize > 2) ? pSize - 1 : 1;
+    old[0] = bounds[0] = 1;
+    for (r = 0; r < slaves; r++){
+        old[r+1] = old[r] + rows[r];
+        bounds[r+1] = bounds[r] + newRows[r];
+    }
+    for (r = 1; r < slaves; r++){
+        lo = old[r] - max(rows[r-1] - minRows, 0) / 2;
+        hi = old[r] + max(rows[r] - minRows, 0) / 2;
+        bounds[r] = min(max(bounds[r], lo), hi);
+    }
+    bounds[slaves] = size + 1;
+
+    for (r = 1; r < slaves; r++){
+        if (bounds[r] != old[r]) return 1;
+    }
+    return 0;
+}
+
+void rebalanceBand(BAND* band, long long busy, int pSize)
+{
+    int size = band->size, width = band->width;
+    int rows[slaves], bounds[slaves + 1];
+    long long allBusy[slaves];
+    int oldFirst, oldLast, first, last, start, stop, g, nReq;
+    int upFirst, upLast, downFirst, downLast;
+    char *fromUp = NULL, *fromDown = NULL, *src;
+    char **cur;
+    MPI_Request req[4];
+    long long t;
+
+    t = monotonicTime();
+    MPI_Gather(&busy, 1, MPI_LONG_LONG, allBusy, 1, MPI_LONG_LONG, 0,
+        workerComm);
+    MPI_Gather(&band->rows, 1, MPI_INT, rows, 1, MPI_INT, 0, workerComm);
+    if (myid == 0 && !planRebalance(size, pSize, rows, allBusy, bounds))
+        bounds[0] = 0;
+    MPI_Bcast(bounds, slaves + 1, MPI_INT, 0, workerComm);
+    if (bounds[0] == 0){
+        phaseEnd(PHASE_REBALANCE, t);
+        return;
+    }
+
+    //Global rows held now and after the move, halo rows included
+    oldFirst = band->start - 1;
+    oldLast = band->start - 2 + band->nRows;
+    start = bounds[myid];
+    stop = bounds[myid + 1];
+    first = start - 1;
+    last = min(stop + pSize - 2, size + 1);
+
+    //Rows this band is missing come from the neighbour across the 
+    //boundary that moved, rows a neighbour is missing are sent to it
+    nReq = 0;
+    upFirst = first;
+    upLast = band->start - 1;
+    if (start < band->start){
+        fromUp = (char*) malloc((upLast - upFirst + 1) * width);
+        if (fromUp == NULL)
+            die(__LINE__);
+        MPI_Irecv(fromUp, (upLast - upFirst + 1) * width, MPI_CHAR, 
+            myid - 1, REBALANCE_TAG, workerComm, &req[nReq++]);
+    }
+    downFirst = band->start + band->rows;
+    downLast = last;
+    if (stop > band->start + band->rows){
+        fromDown = (char*) malloc((downLast - downFirst + 1) * width);
+        if (fromDown == NULL)
+            die(__LINE__);
+        MPI_Irecv(fromDown, (downLast - downFirst + 1) * width, MPI_CHAR, 
+            myid + 1, REBALANCE_TAG, workerComm, &req[nReq++]);
+    }
+    if (start > band->start){
+        g = min(start + pSize - 2, size + 1);
+        MPI_Isend(band->cur[band->start - oldFirst], 
+            (g - band->start + 1) * width, MPI_CHAR, myid - 1, 
+            REBALANCE_TAG, workerComm, &req[nReq++]);
+    }
+    if (stop < band->start + band->rows){
+        g = band->start + band->rows - 1;
+        MPI_Isend(band->cur[stop - 1 - oldFirst], (g - stop + 2) * width,
+            MPI_CHAR, myid + 1, REBALANCE_TAG, workerComm, &req[nReq++]);
+    }
+    MPI_Waitall(nReq, req, MPI_STATUSES_IGNORE);
+
+    cur = allocateBandMatrix(width, last - first + 1);
+    for (g = first; g <= last; g++){
+        if (g >= oldFirst && g <= oldLast)
+            src = band->cur[g - oldFirst];
+        else if (g < oldFirst)
+            src = fromUp + (g - upFirst) * width;
+        else
+            src = fromDown + (g - downFirst) * width;
+        memcpy(cur[g - first], src, width);
+    }
+    free(fromUp);
+    free(fromDown);
+
+    freeBand(band);
+    band->start = start;
+    band->rows = stop - start;
+    band->nRows = last - first + 1;
+    band->cur = cur;
+    band->next = allocateBandMatrix(width, band->nRows);
+    if (opt.bbox)
+        initSpans(band);
+    phaseEnd(PHASE_REBALANCE, t);
+}
+
+/***********************************************************
+   Checkpoint and restart
+***********************************************************/
+
+void checkpointName(char* name, int index)
+{
+    sprintf(name, "%s.%d", opt.checkpointFile, index);
+}
+
+void checkpointBegin(int iteration, int pSize, BAND* band, MATCHLIST* list, 
+        MATCHSINK* sink, WRITER* writer)
+{
+    char name[strlen(opt.checkpointFile) + 16];
+    long long* state;
+    long long n, i;
+    MPI_Offset offset;
+    MPI_Datatype unit, type;
+    MATCH* cur;
+    int size, count;
+    long long t;
+
+    t = monotonicTime();
+    checkpointFinish();
+
+    //Fold the slaves' aggregates into the master's so the saved state
+    //covers every iteration before this one
+    if (sink->mode != QUERY_LIST){
+        reduceSink(sink);
+        if (myid != MASTER_ID)
+            resetSink(sink);
+    }
+
+    checkpointName(name, (iteration / opt.checkpoint) % 2);
+    MPI_File_open(MPI_COMM_WORLD, name, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+        MPI_INFO_NULL, &ckpt.fh);
+
+    //The file being overwritten must not look complete until it is
+    size = sink->size;
+    if (myid == MASTER_ID){
+        memset(&ckpt.header, 0, sizeof(CKPTHEADER));
+        memcpy(ckpt.header.magic, CKPT_MAGIC, 8);
+        ckpt.header.size = size;
+        ckpt.header.pSize = pSize;
+        ckpt.header.iteration = iteration;
+        ckpt.header.query = opt.query;
+        ckpt.header.queryArg = opt.queryArg;
+        MPI_File_write_at(ckpt.fh, 0, &ckpt.header, sizeof(CKPTHEADER),
+            MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_File_sync(ckpt.fh);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if (band != NULL){
+        //owned rows, without their halo columns
+        ckpt.buf = (char*) malloc((size_t) band->rows * size);
+        if (ckpt.buf == NULL)
+            die(__LINE__);
+        for (i = 0; i < band->rows; i++){
+            memcpy(ckpt.buf + i * size, band->cur[i + 1] + 1, size);
+        }
+        offset = CKPT_HEADER_BYTES + (MPI_Offset) (band->start - 1) * size;
+        MPI_Type_contiguous(size, MPI_CHAR, &unit);
+        count = checkpointType(band->rows, unit, &type);
+        MPI_Type_free(&unit);
+    } else {
+        if (sink->mode != QUERY_LIST){
+            n = sink->nCount;
+            state = (long long*) malloc(sizeof(long long) * (n + 1));
+            if (state == NULL)
+                die(__LINE__);
+            memcpy(state, sink->counts, sizeof(long long) * n);
+            count = checkpointType(n, MPI_LONG_LONG, &type);
+        } else if (writer != NULL){
+            //matches so far are in the output file, keep its length
+            n = writerSync(writer);
+            ckpt.header.nMatch = writer->nMatch;
+            state = NULL;
+            count = checkpointType(0, MPI_LONG_LONG, &type);
+        } else {
+            //(iteration, key) of every match not printed yet
+            n = list->nItem;
+            state = (long long*) malloc(sizeof(long long) * (2 * n + 1));
+            if (state == NULL)
+                die(__LINE__);
+            cur = (n > 0) ? list->tail->next : NULL;
+            for (i = 0; i < n; i++, cur = cur->next){
+                state[2 * i] = cur->iteration;
+                state[2 * i + 1] = matchToKey(cur);
+            }
+            count = checkpointType(2 * n, MPI_LONG_LONG, &type);
+        }
+        ckpt.header.nState = n;
+        ckpt.buf = (char*) state;
+        offset = CKPT_HEADER_BYTES + (MPI_Offset) size * size;
+    }
+    //the write keeps its own reference to type
+    MPI_File_iwrite_at(ckpt.fh, offset, ckpt.buf, count, type, &ckpt.req);
+    MPI_Type_free(&type);
+    ckpt.active = 1;
+    phaseEnd(PHASE_CHECKPOINT, t);
+}
+
+int checkpointType(long long n, MPI_Datatype unit, MPI_Datatype* type)
+{
+    MPI_Datatype chunk, part[2];
+    MPI_Aint lb, extent, disp[2];
+    int length[2] = {1, 1};
+
+    if (n <= INT_MAX){
+        MPI_Type_dup(unit, type);
+        MPI_Type_commit(type);
+        return (int) n;
+    }
+    MPI_Type_get_extent(unit, &lb, &extent);
+    MPI_Type_contiguous(CKPT_CHUNK, unit, &chunk);
+    MPI_Type_contiguous((int) (n / CKPT_CHUNK), chunk, &part[0]);
+    MPI_Type_contiguous((int) (n % CKPT_CHUNK), unit, &part[1]);
+    disp[0] = 0;
+    disp[1] = (MPI_Aint) (n - n % CKPT_CHUNK) * extent;
+    MPI_Type_create_struct(2, length, disp, part, type);
+    MPI_Type_commit(type);
+    MPI_Type_free(&chunk);
+    MPI_Type_free(&part[0]);
+    MPI_Type_free(&part[1]);
+    return 1;
+}
+
+void checkpointPoll()
+{
+    int done;
+
+    if (ckpt.active && ckpt.req != MPI_REQUEST_NULL)
+        MPI_Test(&ckpt.req, &done, MPI_STATUS_IGNORE);
+}
+
+void checkpointFinish()
+{
+    long long t;
+
+    if (!ckpt.active)
+        return;
+
+    t = monotonicTime();
+    MPI_Wait(&ckpt.req, MPI_STATUS_IGNORE);
+    MPI_File_sync(ckpt.fh);
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (myid == MASTER_ID){
+        ckpt.header.complete = 1;
+        MPI_File_write_at(ckpt.fh, 0, &ckpt.header, sizeof(CKPTHEADER),
+            MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&ckpt.fh);
+    free(ckpt.buf);
+    ckpt.buf = NULL;
+    ckpt.active = 0;
+    phaseEnd(PHASE_CHECKPOINT, t);
+}
+
+int checkpointLatest(CKPTHEADER* header)
+{
+    char name[strlen(opt.checkpointFile) + 16];
+    CKPTHEADER candidate;
+    FILE* inf;
+    int index, best;
+
+    best = -1;
+    for (index = 0; index < 2; index++){
+        checkpointName(name, index);
+        inf = fopen(name, "rb");
+        if (inf == NULL)
+            continue;
+        if (fread(&candidate, sizeof(CKPTHEADER), 1, inf) == 1 
+                && memcmp(candidate.magic, CKPT_MAGIC, 8) == 0
+                && candidate.complete
+                && (best < 0 || candidate.iteration > header->iteration)){
+            *header = candidate;
+            best = index;
+        }
+        fclose(inf);
+    }
+    return best;
+}
+
+void checkpointReadState(int index, CKPTHEADER* header, MATCHLIST* list,
+        MATCHSINK* sink)
+{
+    char name[strlen(opt.checkpointFile) + 16];
+    long long rec[2], i;
+    MATCH mat;
+    FILE* inf;
+
+    //--output keeps its matches in the output file
+    if (sink->mode == QUERY_LIST && opt.outputFile != NULL)
+        return;
+
+    checkpointName(name, index);
+    inf = fopen(name, "rb");
+    if (inf == NULL || fseeko(inf, CKPT_HEADER_BYTES 
+            + (off_t) header->size * header->size, SEEK_SET) != 0)
+        die(__LINE__);
+
+    if (sink->mode != QUERY_LIST){
+        if (sink->nCount < 0 || header->nState != sink->nCount 
+                || fread(sink->counts, sizeof(long long), sink->nCount, inf)
+                != (size_t) sink->nCount)
+            die(__LINE__);
+    } else {
+        for (i = 0; i < header->nState; i++){
+            if (fread(rec, sizeof(long long), 2, inf) != 2)
+                die(__LINE__);
+            keyToMatch(rec[1], rec[0], &mat);
+            insertEnd(list, mat.iteration, mat.row, mat.col, mat.rotation);
+        }
+    }
+    fclose(inf);
+}
+
+void checkpointReadBand(int index, BAND* band)
+{
+    char name[strlen(opt.checkpointFile) + 16];
+    MPI_Datatype rowType;
+    MPI_File fh;
+    MPI_Offset offset;
+    int rows;
+
+    checkpointName(name, index);
+    MPI_File_open(MPI_COMM_WORLD, name, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+    rows = 0;
+    offset = 0;
+    if (band != NULL){
+        rows = band->rows;
+        offset = CKPT_HEADER_BYTES + (MPI_Offset) (band->start - 1) 
+            * band->size;
+    }
+    //size cells of every owned row, into columns 1..size of the band
+    MPI_Type_vector(max(rows, 1), band != NULL ? band->size : 0, 
+        band != NULL ? band->width : 1, MPI_CHAR, &rowType);
+    MPI_Type_commit(&rowType);
+    MPI_File_read_at_all(fh, offset, band != NULL ? band->cur[1] + 1 : NULL,
+        rows > 0 ? 1 : 0, rowType, MPI_STATUS_IGNORE);
+    MPI_Type_free(&rowType);
+    MPI_File_close(&fh);
+}
+
+/***********************************************************
+   Trajectory tracking
+***********************************************************/
+
+void patternMotion(char** pattern, int pSize, MOTION* motion)
+{
+    char **cur, **next, **temp, want;
+    int board, origin, t, dRow, dCol, i, j, same, found;
+
+    //room for TRACK_MAX_PERIOD cells of movement on every side
+    board = pSize + 2 * (TRACK_MAX_PERIOD + 1);
+    origin = TRACK_MAX_PERIOD + 2;
+    cur = allocateSquareMatrix(board + 2, DEAD);
+    next = allocateSquareMatrix(board + 2, DEAD);
+    for (i = 0; i < pSize; i++){
+        for (j = 0; j < pSize; j++){
+            cur[origin + i][origin + j] = 
+                (pattern[i][j] == ALIVE) ? ALIVE : DEAD;
+        }
+    }
+
+    motion->period = 1;
+    motion->dRow = 0;
+    motion->dCol = 0;
+    found = 0;
+    for (t = 1; !found && t <= TRACK_MAX_PERIOD; t++){
+        evolveBlock(cur, next, 1, board, 1, board);
+        temp = cur;
+        cur = next;
+        next = temp;
+        for (dRow = -t; !found && dRow <= t; dRow++){
+            for (dCol = -t; !found && dCol <= t; dCol++){
+                same = 1;
+                for (i = 1; same && i <= board; i++){
+                    for (j = 1; same && j <= board; j++){
+                        want = DEAD;
+                        if (i - origin - dRow >= 0 && i - origin - dRow < pSize
+                                && j - origin - dCol >= 0 
+                                && j - origin - dCol < pSize)
+                            want = pattern[i - origin - dRow][j - origin - dCol];
+                        same = (want == WILDCARD || cur[i][j] == want);
+                    }
+                }
+                if (same){
+                    motion->period = t;
+                    motion->dRow = dRow;
+                    motion->dCol = dCol;
+                    found = 1;
+                }
+            }
+        }
+    }
+    freeSquareMatrix(cur);
+    free(cur);
+    freeSquareMatrix(next);
+    free(next);
+}
+
+void initTracker(TRACKER* tracker, char** patterns[4], int pSize)
+{
+    int dir, s;
+
+    for (dir = N; dir <= W; dir++){
+        patternMotion(patterns[dir], pSize, &tracker->motion[dir]);
+    }
+    tracker->track = NULL;
+    tracker->nTrack = 0;
+    tracker->trackCap = 0;
+    for (s = 0; s < TRACK_SLOTS; s++){
+        tracker->key[s] = NULL;
+        tracker->id[s] = NULL;
+        tracker->capacity[s] = 0;
+        tracker->iteration[s] = -1;
+    }
+}
+
+//Fibonacci hashing into a power of two table
+static int trackHash(long long key, int capacity)
+{
+    return (int) (((unsigned long long) key * 0x9e3779b97f4a7c15ull) 
+        >> 32) & (capacity - 1);
+}
+
+void trackIteration(TRACKER* tracker, int iteration, long long* keys, 
+        int n)
+{
+    MOTION* m;
+    MATCH mat;
+    long long id, prevKey;
+    int slot, prev, i, h;
+
+    //the slot of iteration - TRACK_SLOTS is reused
+    slot = iteration % TRACK_SLOTS;
+    if (tracker->capacity[slot] < 2 * n){
+        while (tracker->capacity[slot] < 2 * n){
+            tracker->capacity[slot] = tracker->capacity[slot] > 0 
+                ? 2 * tracker->capacity[slot] : 64;
+        }
+        free(tracker->key[slot]);
+        free(tracker->id[slot]);
+        tracker->key[slot] = (long long*) malloc(sizeof(long long) 
+            * tracker->capacity[slot]);
+        tracker->id[slot] = (long long*) malloc(sizeof(long long) 
+            * tracker->capacity[slot]);
+        if (tracker->key[slot] == NULL || tracker->id[slot] == NULL)
+            die(__LINE__);
+    }
+    for (i = 0; i < tracker->capacity[slot]; i++){
+        tracker->key[slot][i] = -1;
+    }
+    tracker->iteration[slot] = iteration;
+
+    for (i = 0; i < n; i++){
+        keyToMatch(keys[i], iteration, &mat);
+        m = &tracker->motion[mat.rotation];
+
+        //the predecessor's track, if it was seen
+        id = -1;
+        prev = (iteration - m->period) % TRACK_SLOTS;
+        if (iteration >= m->period 
+                && tracker->iteration[prev] == iteration - m->period
+                && mat.row >= m->dRow && mat.col >= m->dCol){
+            mat.row -= m->dRow;
+            mat.col -= m->dCol;
+            prevKey = matchToKey(&mat);
+            mat.row += m->dRow;
+            mat.col += m->dCol;
+            for (h = trackHash(prevKey, tracker->capacity[prev]); 
+                    tracker->key[prev][h] != -1; 
+                    h = (h + 1) & (tracker->capacity[prev] - 1)){
+                if (tracker->key[prev][h] == prevKey){
+                    id = tracker->id[prev][h];
+                    break;
+                }
+            }
+        }
+
+        if (id >= 0){
+            tracker->track[id].length++;
+        } else {
+            if (tracker->nTrack == tracker->trackCap){
+                tracker->trackCap = tracker->trackCap > 0 
+                    ? 2 * tracker->trackCap : 1024;
+                tracker->track = (TRACK*) realloc(tracker->track, 
+                    sizeof(TRACK) * tracker->trackCap);
+                if (tracker->track == NULL)
+                    die(__LINE__);
+            }
+            id = tracker->nTrack++;
+            tracker->track[id].iteration = iteration;
+            tracker->track[id].row = mat.row;
+            tracker->track[id].col = mat.col;
+            tracker->track[id].rotation = mat.rotation;
+            tracker->track[id].length = 1;
+        }
+
+        for (h = trackHash(keys[i], tracker->capacity[slot]); 
+                tracker->key[slot][h] != -1; 
+                h = (h + 1) & (tracker->capacity[slot] - 1));
+        tracker->key[slot][h] = keys[i];
+        tracker->id[slot][h] = id;
+    }
+}
+
+void printTracks(TRACKER* tracker)
+{
+    TRACK* tr;
+    long long i;
+    int dir;
+
+    for (dir = N; dir <= W; dir++){
+        printf("Motion %d = period %d, %d rows, %d cols\n", dir, 
+            tracker->motion[dir].period, tracker->motion[dir].dRow, 
+            tracker->motion[dir].dCol);
+    }
+    printf("Track size = %lld\n", tracker->nTrack);
+    for (i = 0; i < tracker->nTrack; i++){
+        tr = &tracker->track[i];
+        printf("%d:%d:%d:%d:%d\n", tr->iteration, tr->row, tr->col, 
+            tr->rotation, tr->length);
+    }
+}
+
+/***********************************************************
+   Cycle detection
+***********************************************************/
+
+void cycleInit(CYCLE* cycle, BAND* band)
+{
+    int i;
+
+    cycle->hash = bandHash(band, &cycle->live);
+    for (i = 0; i < CYCLE_HISTORY; i++){
+        cycle->iteration[i] = -1;
+        cycle->keys[i] = NULL;
+        cycle->nKeys[i] = 0;
+    }
+    cycle->from = 0;
+    cycle->period = 0;
+}
+
+void cycleFree(CYCLE* cycle)
+{
+    int i;
+
+    for (i = 0; i < CYCLE_HISTORY; i++){
+        free(cycle->keys[i]);
+        cycle->keys[i] = NULL;
+    }
+}
+
+//splitmix64 of the cell's position
+unsigned long long cellKey(int row, int col)
+{
+    unsigned long long z;
+
+    z = ((unsigned long long) row << 32 | (unsigned) col) 
+        + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+unsigned long long bandHash(BAND* band, long long* live)
+{
+    unsigned long long hash;
+    int i, j;
+
+    hash = 0;
+    *live = 0;
+    for (i = 1; i <= band->rows; i++){
+        for (j = 1; j <= band->size; j++){
+            if (band->cur[i][j] == ALIVE){
+                hash ^= cellKey(band->start + i - 1, j);
+                (*live)++;
+            }
+        }
+    }
+    return hash;
+}
+
+unsigned long long hashChanges(BAND* band, long long* live)
+{
+    unsigned long long hash;
+    uint64_t a, b;
+    char *cur, *next;
+    int i, j, k;
+
+    //Whole words are compared first, most cells do not change
+    hash = 0;
+    for (i = 1; i <= band->rows; i++){
+        cur = band->cur[i];
+        next = band->next[i];
+        for (j = 1; j + 8 <= band->size + 1; j += 8){
+            memcpy(&a, cur + j, 8);
+            memcpy(&b, next + j, 8);
+            if (a == b)
+                continue;
+            for (k = j; k < j + 8; k++){
+                if (cur[k] != next[k]){
+                    hash ^= cellKey(band->start + i - 1, k);
+                    *live += next[k] == ALIVE ? 1 : -1;
+                }
+            }
+        }
+        for (; j <= band->size; j++){
+            if (cur[j] != next[j]){
+                hash ^= cellKey(band->start + i - 1, j);
+                *live += next[j] == ALIVE ? 1 : -1;
+            }
         }
-        fscanf(inf, "%c", &temp);
     }
-
-    *sizePtr = size;    //return size
-    return world;
-    
+    return hash;
 }
 
-int countNeighbours(char** world, int row, int col)
-//Assume 1 <= row, col <= size, no check 
+int cycleFound(CYCLE* cycle, int iteration)
 {
-    int i, j, count;
-
-    count = 0;
-    for(i = row-1; i <= row+1; i++){
-        for(j = col-1; j <= col+1; j++){
-            count += (world[i][j] == ALIVE );
+    unsigned long long world;
+    long long t, live;
+    int j, slot;
+
+    if (cycle->period > 0)
+        return 1;
+
+    t = monotonicTime();
+    MPI_Allreduce(&cycle->hash, &world, 1, MPI_UNSIGNED_LONG_LONG, MPI_BXOR,
+        workerComm);
+    MPI_Allreduce(&cycle->live, &live, 1, MPI_LONG_LONG, MPI_SUM, 
+        workerComm);
+    phaseEnd(PHASE_TRANSFER, t);
+
+    //The shortest period wins, every slave decides the same
+    for (j = iteration - 1; j > iteration - CYCLE_HISTORY && j >= 0; j--){
+        slot = j % CYCLE_HISTORY;
+        if (cycle->iteration[slot] == j && cycle->world[slot] == world
+                && cycle->worldLive[slot] == live){
+            cycle->from = j;
+            cycle->period = iteration - j;
+            if (opt.showPhases && myid == 0)
+                fprintf(stderr, "CYCLE iteration=%d from=%d period=%d\n",
+                    iteration, j, cycle->period);
+            return 1;
         }
     }
-
-    //discount the center
-    count -= (world[row][col] == ALIVE);
-
-    return count;
-
+    slot = iteration % CYCLE_HISTORY;
+    cycle->world[slot] = world;
+    cycle->worldLive[slot] = live;
+    cycle->iteration[slot] = iteration;
+    return 0;
 }
 
-void evolveWorld(char** curWorld, char** nextWorld, int row ,int col)
+void cycleKeep(CYCLE* cycle, int iteration, long long* keys, int n)
 {
-    int i, j, liveNeighbours;
+    int slot;
 
-    for (i = 1; i <= row; i++){
-        for (j = 1; j <= col; j++){
-            //printf("%d %d\n", i,j);
-            liveNeighbours = countNeighbours(curWorld, i, j);
-            nextWorld[i][j] = DEAD;
-            //Only take care of alive cases
-            if (curWorld[i][j] == ALIVE) {
+    slot = iteration % CYCLE_HISTORY;
+    free(cycle->keys[slot]);
+    cycle->keys[slot] = keys;
+    cycle->nKeys[slot] = n;
+}
 
-                if (liveNeighbours == 2 || liveNeighbours == 3)
-                    nextWorld[i][j] = ALIVE;
+long long* cycleReplay(CYCLE* cycle, int iteration, int* n)
+{
+    int slot;
 
-            } else if (liveNeighbours == 3)
-                    nextWorld[i][j] = ALIVE;
-        } 
-    }
+    slot = (cycle->from + (iteration - cycle->from) % cycle->period) 
+        % CYCLE_HISTORY;
+    *n = cycle->nKeys[slot];
+    return cycle->keys[slot];
 }
 
 /***********************************************************
@@ -669,6 +4386,19 @@ char** readPatternFromFile( char* fname, int* sizePtr )
 }
 
 
+int hasWildcard(char** pattern, int pSize)
+{
+    int i, j;
+
+    for (i = 0; i < pSize; i++){
+        for (j = 0; j < pSize; j++){
+            if (pattern[i][j] == WILDCARD)
+                return 1;
+        }
+    }
+    return 0;
+}
+
 void rotate90(char** current, char** rotated, int size)
 {
     int i, j;
@@ -681,25 +4411,65 @@ void rotate90(char** current, char** rotated, int size)
 }
 
 void searchPatterns(char** world, int wRow, int wCol, int iteration, 
-        char** patterns[4], int pSize, MATCHLIST* list, int rowOffset)
+        char** patterns[4], int pSize, MATCHSINK* sink, int rowOffset)
 {
     int dir;
 
+    if (opt.prefilter && !approxSearch){
+        searchBlockRotations(world, 1, wRow-pSize+1, 1, 
+            opt.torus ? wCol : wCol-pSize+1, wCol, iteration, patterns, 
+            pSize, sink, rowOffset);
+        return;
+    }
     for (dir = N; dir <= W; dir++){
         searchSinglePattern(world, wRow, wCol, iteration, 
-                patterns[dir], pSize, dir, list, rowOffset);
+                patterns[dir], pSize, dir, sink, rowOffset);
     }
 
 }
 
 void searchSinglePattern(char** world, int wSizeRow, int wSizeCol, int iteration,
-        char** pattern, int pSize, int rotation, MATCHLIST* list, int rowOffset)
+        char** pattern, int pSize, int rotation, MATCHSINK* sink, int rowOffset)
 {
-    int wRow, wCol, pRow, pCol, match;
+    //on a torus every column starts a window, the band's wrapped columns
+    //hold the rest
+    searchBlock(world, 1, wSizeRow-pSize+1, 1, 
+        opt.torus ? wSizeCol : wSizeCol-pSize+1, wSizeCol,
+        iteration, pattern, pSize, rotation, sink, rowOffset);
+}
 
+void searchBlock(char** world, int fromRow, int toRow, int fromCol, 
+        int toCol, int wSizeCol, int iteration, char** pattern, int pSize, 
+        int rotation, MATCHSINK* sink, int rowOffset)
+{
+    int wRow, wCol, pRow, pCol, match;
+    MATCHER* matcher;
 
-    for (wRow = 1; wRow <= (wSizeRow-pSize+1); wRow++){
-        for (wCol = 1; wCol <= (wSizeCol-pSize+1); wCol++){
+    if (approxSearch){
+        searchBlockApprox(world, fromRow, toRow, fromCol, toCol, wSizeCol,
+            iteration, pattern, pSize, rotation, sink, rowOffset);
+        return;
+    }
+    matcher = compileMatcher(pattern, pSize, world[1] - world[0]);
+
+    for (wRow = fromRow; wRow <= toRow; wRow++){
+        wCol = fromCol;
+#ifdef HAVE_NEON
+        //rows past the last possible top row record nothing
+        if (opt.torus || wRow-1 + rowOffset <= wSizeCol-pSize)
+            wCol = searchRowNEON(world, wRow, fromCol, toCol, iteration, 
+                pattern, pSize, rotation, sink, wRow-1 + rowOffset);
+#endif
+        for (; matcher != NULL && wCol <= toCol; wCol++){
+            match = matcher->match(world[wRow] + wCol, matcher);
+            if (opt.verify && match 
+                    != windowMatches(world, wRow, wCol, pattern, pSize))
+                verifyFailed("matcher", wRow, wCol);
+            if (match && (opt.torus || wRow-1 + rowOffset <= wSizeCol-pSize))
+                recordMatch(sink, iteration, wRow-1 + rowOffset, wCol-1, 
+                    rotation);
+        }
+        for (; wCol <= toCol; wCol++){
             match = 1;
 #ifdef DEBUGMORE
             printf("S:(%d, %d)\n", wRow-1, wCol-1);
@@ -715,9 +4485,9 @@ void searchSinglePattern(char** world, int wSizeRow, int wSizeCol, int iteration
                     }
                 }
             }
-            if (match && (wRow-1 + rowOffset <= wSizeCol-pSize)){
+            if (match && (opt.torus || wRow-1 + rowOffset <= wSizeCol-pSize)){
 
-                insertEnd(list, iteration, wRow-1 + rowOffset, wCol-1, rotation);
+                recordMatch(sink, iteration, wRow-1 + rowOffset, wCol-1, rotation);
 #ifdef DEBUGMORE
 printf("*** Row = %d, Col = %d\n", wRow-1, wCol-1);
 #endif
@@ -726,6 +4496,756 @@ printf("*** Row = %d, Col = %d\n", wRow-1, wCol-1);
     }
 }
 
+void searchBlockRotations(char** world, int fromRow, int toRow, 
+        int fromCol, int toCol, int wSizeCol, int iteration, 
+        char** patterns[4], int pSize, MATCHSINK* sink, int rowOffset)
+{
+    int dir;
+
+    if (opt.prefilter && !approxSearch){
+        searchBlockPrefilter(world, fromRow, toRow, fromCol, toCol, wSizeCol,
+            iteration, patterns, pSize, sink, rowOffset);
+        return;
+    }
+    for (dir = N; dir <= W; dir++){
+        searchBlock(world, fromRow, toRow, fromCol, toCol, wSizeCol, 
+            iteration, patterns[dir], pSize, dir, sink, rowOffset);
+    }
+}
+
+void searchBlockPrefilter(char** world, int fromRow, int toRow, 
+        int fromCol, int toCol, int wSizeCol, int iteration, 
+        char** patterns[4], int pSize, MATCHSINK* sink, int rowOffset)
+{
+    int *prefix, *strip, *cur, *old, rowCount[4][pSize];
+    int nCols, total, wRow, wCol, pRow, pCol, c, dir, pass;
+    MATCHER* matcher[4];
+    char* row;
+
+    if (toRow < fromRow || toCol < fromCol)
+        return;
+
+    //live cells of each rotation's rows, the total is the same for all
+    for (dir = N; dir <= W; dir++){
+        matcher[dir] = compileMatcher(patterns[dir], pSize, 
+            world[1] - world[0]);
+        total = 0;
+        for (pRow = 0; pRow < pSize; pRow++){
+            rowCount[dir][pRow] = 0;
+            for (pCol = 0; pCol < pSize; pCol++){
+                rowCount[dir][pRow] += (patterns[dir][pRow][pCol] == ALIVE);
+            }
+            total += rowCount[dir][pRow];
+        }
+    }
+
+    //prefix[k] holds the column prefix sums of row wRow+k of the current
+    //windows, a ring indexed by row % pSize, strip[] their sum
+    nCols = toCol - fromCol + pSize;
+    prefix = (int*) malloc(sizeof(int) * (nCols + 1) * (pSize + 1));
+    if (prefix == NULL)
+        die(__LINE__);
+    strip = prefix + (nCols + 1) * pSize;
+    memset(strip, 0, sizeof(int) * (nCols + 1));
+
+    for (wRow = fromRow - pSize + 1; wRow <= toRow; wRow++){
+        //the window rows move down one: row wRow+pSize-1 replaces wRow-1
+        cur = prefix + ((wRow + pSize - 1) % pSize) * (nCols + 1);
+        old = (wRow > fromRow) ? cur : NULL;
+        row = world[wRow + pSize - 1] + fromCol;
+        for (c = 0; c <= nCols; c++){
+            if (old != NULL)
+                strip[c] -= old[c];
+        }
+        cur[0] = 0;
+        for (c = 0; c < nCols; c++){
+            cur[c + 1] = cur[c] + (row[c] == ALIVE);
+        }
+        for (c = 0; c <= nCols; c++){
+            strip[c] += cur[c];
+        }
+        if (wRow < fromRow)
+            continue;
+
+        for (wCol = fromCol; wCol <= toCol; wCol++){
+            c = wCol - fromCol;
+            for (dir = N; dir <= W; dir++){
+                pass = (strip[c + pSize] - strip[c] == total);
+                for (pRow = 0; pass && pRow < pSize; pRow++){
+                    old = prefix + ((wRow + pRow) % pSize) * (nCols + 1);
+                    pass = (old[c + pSize] - old[c] == rowCount[dir][pRow]);
+                }
+                if (!pass){
+                    if (opt.verify && windowMatches(world, wRow, wCol, 
+                            patterns[dir], pSize))
+                        verifyFailed("prefilter", wRow, wCol);
+                    continue;
+                }
+                pass = (matcher[dir] != NULL) 
+                    ? matcher[dir]->match(world[wRow] + wCol, matcher[dir])
+                    : windowMatches(world, wRow, wCol, patterns[dir], pSize);
+                if (pass 
+                        && (opt.torus || wRow-1 + rowOffset <= wSizeCol-pSize))
+                    recordMatch(sink, iteration, wRow-1 + rowOffset, wCol-1,
+                        dir);
+            }
+        }
+    }
+    free(prefix);
+}
+
+//Unrolled compares of the first 1, 4, 8 and 16 cells from cell k on
+#define MATCH_CELL(k) \
+    if (window[m->offset[k]] != m->value[k]) return 0;
+#define MATCH_CELL4(k) \
+    MATCH_CELL(k) MATCH_CELL(k + 1) MATCH_CELL(k + 2) MATCH_CELL(k + 3)
+#define MATCH_CELL8(k) MATCH_CELL4(k) MATCH_CELL4(k + 4)
+#define MATCH_CELL16(k) MATCH_CELL8(k) MATCH_CELL8(k + 8)
+
+static int match3x3(const char* window, const MATCHER* m)
+{
+    MATCH_CELL8(0) MATCH_CELL(8)
+    return 1;
+}
+
+static int match4x4(const char* window, const MATCHER* m)
+{
+    MATCH_CELL16(0)
+    return 1;
+}
+
+static int match5x5(const char* window, const MATCHER* m)
+{
+    MATCH_CELL16(0) MATCH_CELL8(16) MATCH_CELL(24)
+    return 1;
+}
+
+static int match8x8(const char* window, const MATCHER* m)
+{
+    MATCH_CELL16(0) MATCH_CELL16(16) MATCH_CELL16(32) MATCH_CELL16(48)
+    return 1;
+}
+
+MATCHER* compileMatcher(char** pattern, int pSize, long stride)
+{
+    static MATCHER cache[MATCHER_CACHE];
+    static int nextSlot = 0;
+    MATCHER* m;
+    char first;
+    int i, k, pass;
+
+    if (opt.matcher != MATCHER_COMPILED)
+        return NULL;
+    for (i = 0; i < MATCHER_CACHE; i++){
+        if (cache[i].pattern == pattern && cache[i].stride == stride)
+            return cache[i].match != NULL ? &cache[i] : NULL;
+    }
+
+    m = &cache[nextSlot];
+    nextSlot = (nextSlot + 1) % MATCHER_CACHE;
+    m->pattern = pattern;
+    m->stride = stride;
+    switch (pSize){
+    case 3: m->match = match3x3; break;
+    case 4: m->match = match4x4; break;
+    case 5: m->match = match5x5; break;
+    case 8: m->match = match8x8; break;
+    default: m->match = NULL; return NULL;
+    }
+
+    //A live pattern cell matches a cell of the world with probability 
+    //liveDensity, so the rarer state is compared first
+    first = (liveDensity < 0.5) ? ALIVE : DEAD;
+    m->nCell = 0;
+    for (pass = 0; pass < 2; pass++){
+        for (i = 0; i < pSize; i++){
+            for (k = 0; k < pSize; k++){
+                if ((pattern[i][k] == first) != (pass == 0))
+                    continue;
+                m->offset[m->nCell] = i * stride + k;
+                m->value[m->nCell] = pattern[i][k];
+                m->nCell++;
+            }
+        }
+    }
+    return m;
+}
+
+int windowMatches(char** world, int wRow, int wCol, char** pattern, 
+        int pSize)
+{
+    int pRow, pCol, mismatch;
+
+    mismatch = 0;
+    for (pRow = 0; pRow < pSize; pRow++){
+        for (pCol = 0; pCol < pSize; pCol++){
+            if (world[wRow+pRow][wCol+pCol] != pattern[pRow][pCol]
+                    && pattern[pRow][pCol] != WILDCARD 
+                    && ++mismatch > opt.maxMismatch)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+void searchBlockApprox(char** world, int fromRow, int toRow, 
+        int fromCol, int toCol, int wSizeCol, int iteration, char** pattern,
+        int pSize, int rotation, MATCHSINK* sink, int rowOffset)
+{
+    uint64_t *packed, *p, v, r, m, valid, found;
+    int nWords, nBlocks, lastCol, wRow, wCol, pRow, pCol, c, k, nCare;
+    int maxMismatch, b, l, match;
+    char* row;
+
+    if (toRow < fromRow || toCol < fromCol)
+        return;
+    if (pSize > APPROX_MAX_PSIZE){
+        for (wRow = fromRow; wRow <= toRow; wRow++){
+            for (wCol = fromCol; wCol <= toCol; wCol++){
+                if (windowMatches(world, wRow, wCol, pattern, pSize)
+                        && (opt.torus || wRow-1 + rowOffset <= wSizeCol-pSize))
+                    recordMatch(sink, iteration, wRow-1 + rowOffset, wCol-1,
+                        rotation);
+            }
+        }
+        return;
+    }
+
+    //a window can not differ in more cells than the pattern compares
+    nCare = 0;
+    for (pRow = 0; pRow < pSize; pRow++){
+        for (pCol = 0; pCol < pSize; pCol++){
+            nCare += (pattern[pRow][pCol] != WILDCARD);
+        }
+    }
+    maxMismatch = min(opt.maxMismatch, nCare);
+
+    //columns 0..lastCol of rows fromRow..toRow+pSize-1, bit c of word 
+    //c/64 is column c, zero past the block
+    nBlocks = (toCol - fromCol) / 64 + 1;
+    lastCol = toCol + pSize - 1;
+    nWords = (fromCol + 64 * nBlocks + pSize) / 64 + 2;
+    packed = (uint64_t*) calloc((size_t) nWords * (toRow - fromRow + pSize),
+        sizeof(uint64_t));
+    if (packed == NULL)
+        die(__LINE__);
+    for (wRow = fromRow; wRow < toRow + pSize; wRow++){
+        p = packed + (size_t) (wRow - fromRow) * nWords;
+        row = world[wRow];
+        for (c = 0; c + 8 <= lastCol + 1; c += 8){
+            //bit 4 of every cell to the low bit of its byte, then the 
+            //eight bytes gathered into the top byte
+            memcpy(&v, row + c, 8);
+            v = (v >> 4) & 0x0101010101010101ull;
+            p[c / 64] |= ((v * 0x0102040810204080ull) >> 56) << (c % 64);
+        }
+        for (; c <= lastCol; c++){
+            p[c / 64] |= (uint64_t) CELL_BIT(row[c]) << (c % 64);
+        }
+    }
+
+    //64 windows side by side: bit l of over[k] is set once window 
+    //wCol+l differs from the pattern in more than k cells
+    uint64_t over[maxMismatch + 1];
+    for (wRow = fromRow; wRow <= toRow; wRow++){
+        for (b = 0; b < nBlocks; b++){
+            wCol = fromCol + 64 * b;
+            valid = (toCol - wCol >= 63) ? ~0ull 
+                : (1ull << (toCol - wCol + 1)) - 1;
+            for (k = 0; k <= maxMismatch; k++){
+                over[k] = 0;
+            }
+            for (pRow = 0; pRow < pSize; pRow++){
+                p = packed + (size_t) (wRow + pRow - fromRow) * nWords;
+                for (pCol = 0; pCol < pSize; pCol++){
+                    if (pattern[pRow][pCol] == WILDCARD)
+                        continue;
+                    c = wCol + pCol;
+                    r = p[c / 64] >> (c % 64);
+                    if (c % 64 != 0)
+                        r |= p[c / 64 + 1] << (64 - c % 64);
+                    m = (pattern[pRow][pCol] == ALIVE) ? ~r : r;
+                    for (k = maxMismatch; k > 0; k--){
+                        over[k] |= over[k - 1] & m;
+                    }
+                    over[0] |= m;
+                }
+                if ((over[maxMismatch] & valid) == valid)
+                    break;
+            }
+
+            found = ~over[maxMismatch] & valid;
+            for (l = 0; l < 64 && (opt.verify || found != 0); l++){
+                match = (found >> l) & 1;
+                if (opt.verify && ((valid >> l) & 1) && match 
+                        != windowMatches(world, wRow, wCol + l, pattern, pSize))
+                    verifyFailed("approximate search", wRow, wCol + l);
+                if (match && (opt.torus || wRow-1 + rowOffset <= wSizeCol-pSize))
+                    recordMatch(sink, iteration, wRow-1 + rowOffset, 
+                        wCol + l - 1, rotation);
+                found &= ~(1ull << l);
+            }
+        }
+    }
+    free(packed);
+}
+
+#ifdef HAVE_NEON
+int searchRowNEON(char** world, int wRow, int fromCol, int toCol, 
+        int iteration, char** pattern, int pSize, int rotation, 
+        MATCHSINK* sink, int row)
+{
+    uint8x16_t match;
+    uint64x2_t any;
+    uint8_t lanes[16];
+    int wCol, pRow, pCol, l;
+
+    for (wCol = fromCol; wCol + 15 <= toCol; wCol += 16){
+        match = vdupq_n_u8(0xFF);
+        for (pRow = 0; pRow < pSize; pRow++){
+            for (pCol = 0; pCol < pSize; pCol++){
+                match = vandq_u8(match, vceqq_u8(vld1q_u8(
+                    (const uint8_t*) world[wRow+pRow] + wCol + pCol),
+                    vdupq_n_u8(pattern[pRow][pCol])));
+            }
+            //stop once no window of the 16 can match any more
+            any = vreinterpretq_u64_u8(match);
+            if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) == 0 
+                    && !opt.verify)
+                break;
+        }
+
+        vst1q_u8(lanes, match);
+        for (l = 0; l < 16; l++){
+            if (opt.verify && (lanes[l] != 0) 
+                    != windowMatches(world, wRow, wCol + l, pattern, pSize))
+                verifyFailed("search", wRow, wCol + l);
+            if (lanes[l])
+                recordMatch(sink, iteration, row, wCol + l - 1, rotation);
+        }
+    }
+    return wCol;
+}
+#endif
+
+/***********************************************************
+   Match sinks for the list and the aggregate query modes
+***********************************************************/
+
+void initSink(MATCHSINK* sink, int size, int iterations, MATCHLIST* list)
+{
+    long long i;
+
+    sink->mode = opt.query;
+    sink->list = list;
+    for (i = N; i <= W; i++){
+        sink->rotList[i] = NULL;
+    }
+    sink->size = size;
+    sink->log = NULL;
+    switch (sink->mode){
+    case QUERY_LIST:
+        sink->nCount = 0;
+        break;
+    case QUERY_COUNT:
+        sink->nCount = iterations;
+        break;
+    case QUERY_HISTOGRAM:
+        sink->tile = opt.queryArg;
+        sink->tilesPerRow = (size + sink->tile - 1) / sink->tile;
+        sink->nCount = (long long) sink->tilesPerRow * sink->tilesPerRow;
+        break;
+    case QUERY_FIRST_K:
+        sink->nCount = opt.queryArg;
+        break;
+    }
+
+    sink->counts = (long long*) malloc(sizeof(long long) * (sink->nCount + 1));
+    if (sink->counts == NULL)
+        die(__LINE__);
+    resetSink(sink);
+}
+
+void resetSink(MATCHSINK* sink)
+{
+    long long i, fill;
+
+    fill = (sink->mode == QUERY_FIRST_K) ? LLONG_MAX : 0;
+    for (i = 0; i < sink->nCount; i++){
+        sink->counts[i] = fill;
+    }
+    sink->nFirst = 0;
+}
+
+void recordMatch(MATCHSINK* sink, int iteration, int row, int col, 
+        int rotation)
+{
+    long long key, i;
+
+    if (sink->log != NULL)
+        insertEnd(sink->log, iteration, row, col, rotation);
+    switch (sink->mode){
+    case QUERY_LIST:
+        insertEnd(sink->rotList[rotation] != NULL ? sink->rotList[rotation]
+            : sink->list, iteration, row, col, rotation);
+        break;
+    case QUERY_COUNT:
+        sink->counts[iteration]++;
+        break;
+    case QUERY_HISTOGRAM:
+        sink->counts[(row / sink->tile) * sink->tilesPerRow 
+            + col / sink->tile]++;
+        break;
+    case QUERY_FIRST_K:
+        //Keep the k smallest keys sorted.  The unfused search finds them
+        //in output order, so this only ever appends there; --fused, 
+        //--prefilter and --bbox interleave the rotations and insert 
+        //within one iteration.
+        key = firstKey(sink->size, iteration, row, col, rotation);
+        if (sink->nFirst == sink->nCount){
+            if (key >= sink->counts[sink->nCount - 1])
+                break;
+            sink->nFirst--;
+        }
+        for (i = sink->nFirst; i > 0 && sink->counts[i - 1] > key; i--){
+            sink->counts[i] = sink->counts[i - 1];
+        }
+        sink->counts[i] = key;
+        sink->nFirst++;
+        break;
+    }
+}
+
+void flushRotations(MATCHSINK* sink)
+{
+    int dir;
+
+    for (dir = N; dir <= W; dir++){
+        if (sink->rotList[dir] != NULL)
+            appendList(sink->list, sink->rotList[dir]);
+    }
+}
+
+int sinkFull(MATCHSINK* sink)
+{
+    return sink->mode == QUERY_FIRST_K && sink->nFirst == sink->nCount;
+}
+
+long long firstKey(int size, int iteration, int row, int col, int rotation)
+{
+    return (((long long) iteration * 4 + rotation) * size + row) * size + col;
+}
+
+//MPI_Op for --first-k: both buffers hold one sorted array of k keys,
+//LLONG_MAX padded, and inout becomes the k smallest of the two
+void mergeFirstK(void* in, void* inout, int* len, MPI_Datatype* type)
+{
+    long long *a = (long long*) in, *b = (long long*) inout, *merged;
+    int i, j, n, k;
+
+    (void) type;
+    k = opt.queryArg;
+    merged = (long long*) malloc(sizeof(long long) * k);
+    if (merged == NULL)
+        die(__LINE__);
+    for (n = 0; n < *len; n++, a += k, b += k){
+        for (i = 0, j = 0; i + j < k; ){
+            if (a[i] <= b[j]){
+                merged[i + j] = a[i];
+                i++;
+            } else {
+                merged[i + j] = b[j];
+                j++;
+            }
+        }
+        memcpy(b, merged, sizeof(long long) * k);
+    }
+    free(merged);
+}
+
+void reduceSink(MATCHSINK* sink)
+{
+    MPI_Datatype keys;
+    MPI_Op op;
+    void* sendbuf;
+
+    sendbuf = (myid == MASTER_ID) ? MPI_IN_PLACE : (void*) sink->counts;
+    if (sink->mode == QUERY_FIRST_K){
+        MPI_Type_contiguous(sink->nCount, MPI_LONG_LONG, &keys);
+        MPI_Type_commit(&keys);
+        MPI_Op_create(mergeFirstK, 1, &op);
+        MPI_Reduce(sendbuf, sink->counts, 1, keys, op, MASTER_ID,
+            MPI_COMM_WORLD);
+        MPI_Op_free(&op);
+        MPI_Type_free(&keys);
+    } else {
+        MPI_Reduce(sendbuf, sink->counts, sink->nCount, MPI_LONG_LONG,
+            MPI_SUM, MASTER_ID, MPI_COMM_WORLD);
+    }
+}
+
+void printSink(MATCHSINK* sink)
+{
+    long long i, total;
+    int size = sink->size, key4;
+
+    total = 0;
+    if (sink->mode == QUERY_FIRST_K){
+        while (total < sink->nCount && sink->counts[total] != LLONG_MAX){
+            total++;
+        }
+    } else {
+        for (i = 0; i < sink->nCount; i++){
+            total += sink->counts[i];
+        }
+    }
+    printf("List size = %lld\n", total);
+
+    switch (sink->mode){
+    case QUERY_COUNT:
+        for (i = 0; i < sink->nCount; i++){
+            printf("%lld:%lld\n", i, sink->counts[i]);
+        }
+        break;
+    case QUERY_HISTOGRAM:
+        printf("Tile size = %d\n", sink->tile);
+        for (i = 0; i < sink->nCount; i++){
+            printf("%lld%c", sink->counts[i], 
+                (i + 1) % sink->tilesPerRow == 0 ? '\n' : ' ');
+        }
+        break;
+    case QUERY_FIRST_K:
+        for (i = 0; i < total; i++){
+            key4 = sink->counts[i] / ((long long) size * size);
+            printf("%d:%lld:%lld:%d\n", key4 / 4, 
+                sink->counts[i] / size % size, sink->counts[i] % size,
+                key4 % 4);
+        }
+        break;
+    }
+}
+
+/***********************************************************
+   Streaming match writer
+***********************************************************/
+
+void* writerThread(void* arg)
+{
+    WRITER* writer = (WRITER*) arg;
+    size_t written;
+    int idx;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;){
+        while (writer->queued == 0 && !writer->closing){
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        if (writer->queued == 0)
+            break;
+        idx = writer->writeIdx;
+        pthread_mutex_unlock(&writer->lock);
+
+        written = fwrite(writer->buf[idx], 1, writer->len[idx], 
+            writer->outf);
+
+        //the buffer is released either way, so the master never waits on
+        //it, and finds the failure when it next hands a buffer over
+        pthread_mutex_lock(&writer->lock);
+        if (written != writer->len[idx])
+            writer->failed = 1;
+        writer->writeIdx = (writer->writeIdx + 1) % WRITER_BUFFERS;
+        writer->queued--;
+        pthread_cond_signal(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+void writerOpen(WRITER* writer, char* fname, int binary, int size, int pSize,
+        long long resumeAt)
+{
+    int i, header[2];
+
+    //Whatever the master printed so far must come first on stdout
+    fflush(stdout);
+    if (strcmp(fname, "-") == 0)
+        writer->outf = stdout;
+    else if (resumeAt >= 0){
+        writer->outf = fopen(fname, binary ? "r+b" : "r+");
+        if (writer->outf == NULL || ftruncate(fileno(writer->outf), resumeAt)
+                != 0 || fseek(writer->outf, 0, SEEK_END) != 0)
+            die(__LINE__);
+    } else 
+        writer->outf = fopen(fname, binary ? "wb" : "w");
+    if (writer->outf == NULL)
+        die(__LINE__);
+
+    for (i = 0; i < WRITER_BUFFERS; i++){
+        writer->buf[i] = (char*) malloc(WRITER_BUFFER_SIZE);
+        if (writer->buf[i] == NULL)
+            die(__LINE__);
+    }
+    writer->binary = binary;
+    writer->fillIdx = writer->writeIdx = 0;
+    writer->fillLen = 0;
+    writer->queued = 0;
+    writer->closing = 0;
+    writer->failed = 0;
+    writer->nMatch = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+
+    if (binary && resumeAt < 0){
+        header[0] = size;
+        header[1] = pSize;
+        memcpy(writer->buf[0], WRITER_MAGIC, 8);
+        memcpy(writer->buf[0] + 8, header, sizeof(header));
+        writer->fillLen = 8 + sizeof(header);
+    }
+
+    if (pthread_create(&writer->thread, NULL, writerThread, writer) != 0)
+        die(__LINE__);
+}
+
+//Hand the buffer being filled to the writer thread and move on to the
+//next one, waiting only when every buffer is still queued for writing
+void writerSubmit(WRITER* writer)
+{
+    if (writer->fillLen == 0)
+        return;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->len[writer->fillIdx] = writer->fillLen;
+    writer->queued++;
+    pthread_cond_signal(&writer->changed);
+    while (writer->queued == WRITER_BUFFERS){
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    writerCheck(writer);
+
+    writer->fillIdx = (writer->fillIdx + 1) % WRITER_BUFFERS;
+    writer->fillLen = 0;
+}
+
+//Decimal digits of a non-negative value, no sprintf
+char* formatInt(char* out, int value)
+{
+    char digits[12];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (n > 0){
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+void writerIteration(WRITER* writer, int iteration, long long keys[], int nKey)
+{
+    MATCH mat;
+    char* out;
+    int i, record[2];
+
+    if (nKey == 0)
+        return;
+    writer->nMatch += nKey;
+
+    if (writer->binary){
+        //Block header: iteration, count, then (row, col << 2 | rotation)
+        if (writer->fillLen + sizeof(record) > WRITER_BUFFER_SIZE)
+            writerSubmit(writer);
+        record[0] = iteration;
+        record[1] = nKey;
+        memcpy(writer->buf[writer->fillIdx] + writer->fillLen, record,
+            sizeof(record));
+        writer->fillLen += sizeof(record);
+        for (i = 0; i < nKey; i++){
+            if (writer->fillLen + sizeof(record) > WRITER_BUFFER_SIZE)
+                writerSubmit(writer);
+            keyToMatch(keys[i], iteration, &mat);
+            record[0] = mat.row;
+            record[1] = mat.col << 2 | mat.rotation;
+            memcpy(writer->buf[writer->fillIdx] + writer->fillLen, record,
+                sizeof(record));
+            writer->fillLen += sizeof(record);
+        }
+        return;
+    }
+
+    for (i = 0; i < nKey; i++){
+        if (writer->fillLen + WRITER_MAX_LINE > WRITER_BUFFER_SIZE)
+            writerSubmit(writer);
+        keyToMatch(keys[i], iteration, &mat);
+        out = writer->buf[writer->fillIdx] + writer->fillLen;
+        out = formatInt(out, mat.iteration);
+        *out++ = ':';
+        out = formatInt(out, mat.row);
+        *out++ = ':';
+        out = formatInt(out, mat.col);
+        *out++ = ':';
+        out = formatInt(out, mat.rotation);
+        *out++ = '\n';
+        writer->fillLen = out - writer->buf[writer->fillIdx];
+    }
+}
+
+long long writerSync(WRITER* writer)
+{
+    writerSubmit(writer);
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued > 0){
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    writerCheck(writer);
+
+    if (fflush(writer->outf) != 0)
+        die(__LINE__);
+    return writer->outf == stdout ? -1 : ftell(writer->outf);
+}
+
+long long writerClose(WRITER* writer)
+{
+    int i;
+
+    writerSubmit(writer);
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = 1;
+    pthread_cond_signal(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    writerCheck(writer);
+
+    if (writer->outf == stdout)
+        fflush(stdout);
+    else if (fclose(writer->outf) != 0)
+        die(__LINE__);
+
+    for (i = 0; i < WRITER_BUFFERS; i++){
+        free(writer->buf[i]);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    return writer->nMatch;
+}
+
+void writerCheck(WRITER* writer)
+{
+    int failed;
+
+    pthread_mutex_lock(&writer->lock);
+    failed = writer->failed;
+    pthread_mutex_unlock(&writer->lock);
+    if (failed){
+        fprintf(stderr, "Writing the matches failed. Exiting\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
 /***********************************************************
    Simple circular linked list for match records
 ***********************************************************/
@@ -788,6 +5308,28 @@ void insertEnd(MATCHLIST* list,
 
 }
 
+void appendList(MATCHLIST* list, MATCHLIST* src)
+{
+    MATCH* head;
+
+    if (src->nItem == 0)
+        return;
+
+    if (list->nItem == 0){
+        list->tail = src->tail;
+    } else {
+        //both lists are circular, swap the links to their heads
+        head = list->tail->next;
+        list->tail->next = src->tail->next;
+        src->tail->next = head;
+        list->tail = src->tail;
+    }
+    list->nItem += src->nItem;
+
+    src->nItem = 0;
+    src->tail = NULL;
+}
+
 void printList(MATCHLIST* list)
 {
     int i;
@@ -805,43 +5347,41 @@ void printList(MATCHLIST* list)
     }
 }
 
-int* transferListToArr(MATCHLIST* list)
+long long* transferListToArr(MATCHLIST* list)
 {
     int i;
     MATCH* cur;
 
-    int *arr = (int*) malloc(sizeof(int) * list->nItem);
+    long long *arr = (long long*) malloc(sizeof(long long) * list->nItem);
 
     if (list->nItem == 0) return arr;
 
     cur = list->tail->next;
     for( i = 0; i < list->nItem; i++, cur=cur->next){
         //printf("%d:%d:%d:%d\n", cur->iteration, cur->row, cur->col, cur->rotation);
-        arr[i] = matchToInt(cur);
+        arr[i] = matchToKey(cur);
     }
     return arr;
 }
 
-int matchToInt(MATCH *mat){
-    return (mat->row * 10000 + mat->col*1 + mat->rotation*100000000);
+long long matchToKey(MATCH *mat){
+    return ((mat->rotation * MATCH_KEY_BASE) + mat->row) * MATCH_KEY_BASE 
+        + mat->col;
 } 
 
-MATCH* intToMatch(int index, int iteration){
-    MATCH* newItem;
-    newItem = (MATCH*) malloc(sizeof(MATCH));
-    newItem->col = index % 10000;
-    index /= 10000;
-    newItem->row = index % 10000;
-    index /= 10000;
+void keyToMatch(long long key, int iteration, MATCH* newItem){
+    newItem->col = key % MATCH_KEY_BASE;
+    key /= MATCH_KEY_BASE;
+    newItem->row = key % MATCH_KEY_BASE;
+    key /= MATCH_KEY_BASE;
     newItem->iteration = iteration;
-    newItem->rotation = index;
-    return newItem;
+    newItem->rotation = key;
 }
 
 int sortFunction( const void *a, const void *b){
-        if(*(int*)a>*(int*)b)
+        if(*(long long*)a>*(long long*)b)
                 return 1;
-        else if(*(int*)a<*(int*)b)
+        else if(*(long long*)a<*(long long*)b)
                 return -1;
         else
                 return 0;
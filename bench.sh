@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# Benchmark harness for SETL and SETL_par.
+#
+# Sweeps world size, live density, pattern, iteration count and rank
+# count over seeded genWorld worlds, runs every configuration REPS times
+# and writes the per-phase medians to <outdir>/results.csv and
+# <outdir>/results.json.
+#
+# Usage: ./bench.sh [outdir]          (or: make bench)
+#
+# Every sweep dimension can be overridden from the environment, e.g.
+#   SIZES="1000 2000" RANKS="2 4" REPS=5 ./bench.sh
+#
+# RANKS counts slaves, SETL_par is started with one extra process for
+# the master.  A rank count of 0 runs the sequential SETL instead.
+# SETL has no threads, so there is no separate thread dimension.
+#
+# VARIANTS lists SETL_par option sets to compare, options within a set
+# are separated by commas and "none" is the plain run, e.g.
+#   VARIANTS="none --fused --tile=auto,--rebalance=4"
+# The sequential SETL only runs the "none" variant.
+
+OUT=${1:-bench_out}
+SIZES=${SIZES:-"500 1000"}
+DENSITIES=${DENSITIES:-"30 50"}
+PATTERNS=${PATTERNS:-"Data/glider3.p Data/glider5.p"}
+ITERS=${ITERS:-"20"}
+RANKS=${RANKS:-"0 1 2 4"}
+REPS=${REPS:-3}
+SEED=${SEED:-3210}
+MPIRUN=${MPIRUN:-mpirun}
+MPIFLAGS=${MPIFLAGS:-}
+EXTRA=${EXTRA:-}
+VARIANTS=${VARIANTS:-none}
+
+PHASES="load evolve search comm merge print total cells_per_sec"
+
+mkdir -p "$OUT/worlds" || exit 1
+CSV="$OUT/results.csv"
+JSON="$OUT/results.json"
+REPFILE="$OUT/reps.txt"
+
+#Median of the field $1 over all PHASES lines in $REPFILE
+median()
+{
+    sed -n "s/.* $1=\([0-9.eE+-]*\).*/\1/p" "$REPFILE" | sort -g |
+        awk '{ v[NR] = $1 }
+             END { if (NR == 0) print "null";
+                   else if (NR % 2) print v[(NR + 1) / 2];
+                   else printf "%.6f\n", (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+echo "program,variant,size,density,pattern,iterations,ranks,reps,$(echo $PHASES |
+    tr ' ' ',')" > "$CSV"
+echo "[" > "$JSON"
+first=1
+
+for size in $SIZES; do
+for density in $DENSITIES; do
+    world="$OUT/worlds/w${size}_${density}_${SEED}.w"
+    if [ ! -f "$world" ]; then
+        ./genWorld "$size" "$density" "$world" "$SEED" > /dev/null || exit 1
+    fi
+
+    for pattern in $PATTERNS; do
+    for iters in $ITERS; do
+    for ranks in $RANKS; do
+    for variant in $VARIANTS; do
+        vopts=$(echo "$variant" | tr ',' ' ')
+        if [ "$variant" = none ]; then vopts=""; fi
+        if [ "$ranks" -eq 0 ]; then
+            if [ "$variant" != none ]; then continue; fi
+            prog=SETL
+            cmd="./SETL $world $iters $pattern --phases $EXTRA"
+        else
+            prog=SETL_par
+            cmd="$MPIRUN $MPIFLAGS -np $((ranks + 1)) ./SETL_par $world $iters $pattern --phases $vopts $EXTRA"
+        fi
+
+        : > "$REPFILE"
+        rep=0
+        while [ $rep -lt "$REPS" ]; do
+            if ! $cmd 2>&1 > /dev/null | grep '^PHASES' >> "$REPFILE"; then
+                echo "bench: '$cmd' failed" >&2
+                exit 1
+            fi
+            rep=$((rep + 1))
+        done
+
+        row="$prog,$variant,$size,$density,$pattern,$iters,$ranks,$REPS"
+        obj="{\"program\": \"$prog\", \"variant\": \"$variant\","
+        obj="$obj \"size\": $size, \"density\": $density,"
+        obj="$obj \"pattern\": \"$pattern\", \"iterations\": $iters,"
+        obj="$obj \"ranks\": $ranks, \"reps\": $REPS"
+        for phase in $PHASES; do
+            m=$(median $phase)
+            row="$row,$m"
+            obj="$obj, \"$phase\": $m"
+        done
+        echo "$row" >> "$CSV"
+        echo "$row" >&2
+
+        if [ $first -eq 0 ]; then echo "," >> "$JSON"; fi
+        printf "  %s}" "$obj" >> "$JSON"
+        first=0
+    done
+    done
+    done
+    done
+done
+done
+
+printf "\n]\n" >> "$JSON"
+rm -f "$REPFILE"
+echo "bench: results in $CSV and $JSON" >&2
@@ -9,7 +9,8 @@ int main(int argc, char** argv)
     FILE* outf;
 
     if (argc < 4){
-        printf("%s <world size> <percentage of live> <output file>\n", argv[0]);
+        printf("%s <world size> <percentage of live> <output file> [seed]\n",
+                argv[0]);
         return 1;
     }
 
@@ -24,7 +25,11 @@ int main(int argc, char** argv)
     fprintf(outf, "%d\n", N);
 
         
-    srand48(time(NULL));
+    //A fixed seed gives a reproducible world (used by bench.sh)
+    if (argc > 4)
+        srand48(atol(argv[4]));
+    else
+        srand48(time(NULL));
     for (i = 0; i < N; i++) {
         for (j = 0; j < N; j++){
             if (drand48() < livePercent){
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <mpi.h>
+
+/***********************************************************
+  Halo exchange microbenchmark for SETL_par.
+
+  Every rank holds a band of a chain and swaps halo rows with the
+  ranks above and below it as SETL_par does each generation: rows-1
+  rows of width cells up and one row down.  The exchange is timed
+  five ways:
+
+    blocking     MPI_Sendrecv per row, a tag per generation and row
+    nonblocking  MPI_Irecv, MPI_Isend and MPI_Waitall
+    persistent   MPI_Recv_init / MPI_Send_init once, then MPI_Startall
+                 and MPI_Waitall every generation
+    rma          MPI_Put into the neighbours' windows, in
+                 post-start-complete-wait epochs with the neighbours
+    rma-fence    MPI_Put in fence epochs over all ranks
+
+  Each width is run for <reps> exchanges after a warm up, the master
+  (rank 0) prints the mean time per exchange of the slowest rank.
+
+  Usage: mpirun -np <n> ./haloBench [--reps=<n>] [--rows=<pSize>]
+             [--widths=<w1,w2,...>]
+***********************************************************/
+
+#define DEFAULT_REPS 1000
+#define DEFAULT_ROWS 3
+#define WARMUP_REPS 10
+#define MAX_WIDTHS 32
+
+#define UP_TAG 2
+#define DOWN_TAG 3
+
+#define BLOCKING 0
+#define NONBLOCKING 1
+#define PERSISTENT 2
+#define RMA 3
+#define RMA_FENCE 4
+#define NMODES 5
+
+int myid, nprocs;
+
+//For exiting on error condition
+void die(int lineNo);
+
+long long monotonicTime();
+
+//Mean ns per exchange of reps exchanges of rows-1 rows up and one row
+//down, each width cells
+long long benchExchange(int mode, int width, int rows, int reps);
+
+
+int main( int argc, char** argv)
+{
+    static const char* modeName[NMODES] = {
+        "blocking", "nonblocking", "persistent", "rma", "rma-fence"};
+    int widths[MAX_WIDTHS] = {64, 256, 1024, 4096, 16384, 65536};
+    int nWidths = 6, reps = DEFAULT_REPS, rows = DEFAULT_ROWS;
+    int i, w, mode;
+    long long ns, worst;
+    char* p;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+
+    for (i = 1; i < argc; i++){
+        if (strncmp(argv[i], "--reps=", 7) == 0){
+            reps = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--rows=", 7) == 0){
+            rows = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--widths=", 9) == 0){
+            nWidths = 0;
+            for (p = argv[i] + 9; *p != '\0' && nWidths < MAX_WIDTHS; ){
+                widths[nWidths++] = strtol(p, &p, 10);
+                if (*p == ',')
+                    p++;
+            }
+        } else {
+            if (myid == 0)
+                fprintf(stderr, "Usage: %s [--reps=<n>] [--rows=<pSize>]"
+                    " [--widths=<w1,w2,...>]\n", argv[0]);
+            MPI_Finalize();
+            exit(1);
+        }
+    }
+    if (reps <= 0 || rows < 2){
+        if (myid == 0)
+            fprintf(stderr, "--reps must be positive and --rows at least 2\n");
+        MPI_Finalize();
+        exit(1);
+    }
+    if (nprocs < 2){
+        if (myid == 0)
+            fprintf(stderr, "%s needs at least 2 ranks\n", argv[0]);
+        MPI_Finalize();
+        exit(1);
+    }
+    for (w = 0; w < nWidths; w++){
+        if (widths[w] <= 0){
+            if (myid == 0)
+                fprintf(stderr, "Bad width %d\n", widths[w]);
+            MPI_Finalize();
+            exit(1);
+        }
+    }
+
+    if (myid == 0)
+        printf("%8s %12s %12s %12s %12s %12s   (us per exchange, %d ranks,"
+            " %d rows)\n", "width", modeName[BLOCKING], 
+            modeName[NONBLOCKING], modeName[PERSISTENT], modeName[RMA], 
+            modeName[RMA_FENCE], nprocs, rows);
+    for (w = 0; w < nWidths; w++){
+        if (myid == 0)
+            printf("%8d", widths[w]);
+        for (mode = 0; mode < NMODES; mode++){
+            ns = benchExchange(mode, widths[w], rows, reps);
+            MPI_Reduce(&ns, &worst, 1, MPI_LONG_LONG, MPI_MAX, 0,
+                MPI_COMM_WORLD);
+            if (myid == 0)
+                printf(" %12.3f", worst / 1e3);
+        }
+        if (myid == 0)
+            printf("\n");
+    }
+
+    MPI_Finalize();
+    return 0;
+}
+
+long long benchExchange(int mode, int width, int rows, int reps)
+{
+    int up, down, nUp, rep, j, tag;
+    char *toUp, *toDown, *fromUp, *fromDown;
+    MPI_Request req[4];
+    MPI_Status status;
+    MPI_Win win;
+    MPI_Group all, neighbours;
+    int ranks[2], nRanks = 0;
+    long long begin = 0;
+
+    up = myid == 0 ? MPI_PROC_NULL : myid - 1;
+    down = myid == nprocs - 1 ? MPI_PROC_NULL : myid + 1;
+    nUp = (rows - 1) * width;
+    toUp = (char*) malloc(2 * (nUp + width));
+    if (toUp == NULL)
+        die(__LINE__);
+    toDown = toUp + nUp;
+    fromUp = toDown + width;
+    fromDown = fromUp + width;
+    memset(toUp, 'O', 2 * (nUp + width));
+
+    if (mode == PERSISTENT){
+        MPI_Recv_init(fromUp, width, MPI_CHAR, up, DOWN_TAG,
+            MPI_COMM_WORLD, &req[0]);
+        MPI_Recv_init(fromDown, nUp, MPI_CHAR, down, UP_TAG,
+            MPI_COMM_WORLD, &req[1]);
+        MPI_Send_init(toUp, nUp, MPI_CHAR, up, UP_TAG, MPI_COMM_WORLD,
+            &req[2]);
+        MPI_Send_init(toDown, width, MPI_CHAR, down, DOWN_TAG,
+            MPI_COMM_WORLD, &req[3]);
+    }
+    if (mode == RMA || mode == RMA_FENCE){
+        //fromUp then fromDown, rows to up land at offset width
+        MPI_Win_create(fromUp, width + nUp, 1, MPI_INFO_NULL, 
+            MPI_COMM_WORLD, &win);
+        if (up != MPI_PROC_NULL)
+            ranks[nRanks++] = up;
+        if (down != MPI_PROC_NULL)
+            ranks[nRanks++] = down;
+        MPI_Comm_group(MPI_COMM_WORLD, &all);
+        MPI_Group_incl(all, nRanks, ranks, &neighbours);
+        MPI_Group_free(&all);
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    for (rep = -WARMUP_REPS; rep < reps; rep++){
+        if (rep == 0){
+            MPI_Barrier(MPI_COMM_WORLD);
+            begin = monotonicTime();
+        }
+        switch (mode){
+        case BLOCKING:
+            //one message per row and a tag per generation and row, as 
+            //exchangeHalo.  Paired by MPI_Sendrecv, rows past the eager
+            //limit would otherwise deadlock.
+            tag = (rep + WARMUP_REPS) % (32767 / rows) * rows;
+            for (j = 0; j < rows - 1; j++){
+                MPI_Sendrecv(toUp + j * width, width, MPI_CHAR, up, tag + j,
+                    fromDown + j * width, width, MPI_CHAR, down, tag + j,
+                    MPI_COMM_WORLD, &status);
+            }
+            MPI_Sendrecv(toDown, width, MPI_CHAR, down, tag + rows - 1,
+                fromUp, width, MPI_CHAR, up, tag + rows - 1,
+                MPI_COMM_WORLD, &status);
+            break;
+        case NONBLOCKING:
+            MPI_Irecv(fromUp, width, MPI_CHAR, up, DOWN_TAG,
+                MPI_COMM_WORLD, &req[0]);
+            MPI_Irecv(fromDown, nUp, MPI_CHAR, down, UP_TAG,
+                MPI_COMM_WORLD, &req[1]);
+            MPI_Isend(toUp, nUp, MPI_CHAR, up, UP_TAG, MPI_COMM_WORLD,
+                &req[2]);
+            MPI_Isend(toDown, width, MPI_CHAR, down, DOWN_TAG,
+                MPI_COMM_WORLD, &req[3]);
+            MPI_Waitall(4, req, MPI_STATUSES_IGNORE);
+            break;
+        case PERSISTENT:
+            MPI_Startall(4, req);
+            MPI_Waitall(4, req, MPI_STATUSES_IGNORE);
+            break;
+        case RMA:
+            MPI_Win_post(neighbours, 0, win);
+            MPI_Win_start(neighbours, 0, win);
+            if (up != MPI_PROC_NULL)
+                MPI_Put(toUp, nUp, MPI_CHAR, up, width, nUp, MPI_CHAR, win);
+            if (down != MPI_PROC_NULL)
+                MPI_Put(toDown, width, MPI_CHAR, down, 0, width, MPI_CHAR,
+                    win);
+            MPI_Win_complete(win);
+            MPI_Win_wait(win);
+            break;
+        case RMA_FENCE:
+            MPI_Win_fence(MPI_MODE_NOPRECEDE, win);
+            if (up != MPI_PROC_NULL)
+                MPI_Put(toUp, nUp, MPI_CHAR, up, width, nUp, MPI_CHAR, win);
+            if (down != MPI_PROC_NULL)
+                MPI_Put(toDown, width, MPI_CHAR, down, 0, width, MPI_CHAR,
+                    win);
+            MPI_Win_fence(MPI_MODE_NOSUCCEED, win);
+            break;
+        }
+    }
+    begin = monotonicTime() - begin;
+
+    if (mode == PERSISTENT){
+        for (j = 0; j < 4; j++){
+            MPI_Request_free(&req[j]);
+        }
+    }
+    if (mode == RMA || mode == RMA_FENCE){
+        MPI_Win_free(&win);
+        MPI_Group_free(&neighbours);
+    }
+    free(toUp);
+    return begin / reps;
+}
+
+void die(int lineNo)
+{
+    fprintf(stderr, "Error at line %d. Exiting\n", lineNo);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+}
+
+long long monotonicTime( )
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (long long)(tp.tv_nsec + (long long)tp.tv_sec * 1000000000ll);
+}